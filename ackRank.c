@@ -0,0 +1,210 @@
+/**
+ *  @file   ackRank.c
+ *  @author Ron Weiland, Indyme Solutions
+ *  @date   4/17/15
+ *  @brief  Phone ack history
+ *
+ *  @section Description
+ *
+ * Counts the alerts of each department every phone took, and how many of
+ * them it acked.  The time from the alert reaching the phone to the ack is
+ * smoothed the same way spConn smooths round trip times.\n
+ * Counts are halved once a phone has taken ACKRANK_MAX_HISTORY alerts for a
+ * department, so the ranking follows who is working now.\n
+ * Phones are kept sorted by IP address in each department.  History is
+ * only kept in memory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ackRank.h"
+#include "spRec.h"
+#include "logging.h"
+
+#define ACKRANK_UNKNOWN_MS  10000      // time to ack assumed for phones that never acked
+
+/*--- History of one phone for one department ---*/
+typedef struct
+{
+   char ip_addr[MAX_IP_ADDR+1];        // phone
+   int delivered;                      // alerts phone took
+   int acks;                           // alarms phone acked
+   long ack_ms;                        // smoothed time to ack (0 if never acked)
+   int last_alarm;                     // last alert phone took
+   long last_ms;                       // when it took it
+}ackPhone_t;
+
+static struct
+{
+   char *name;                         // department
+   int n_phones;
+   int max_phones;
+   ackPhone_t *phones;                 // sorted by IP address
+}depts[ ACKRANK_MAX_DEPTS ];
+static int n_depts;
+static pthread_mutex_t ackRank_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+ackPhone_t *_ackRank_Find( char *dept, char *ip_addr, int create );
+long _ackRank_NowMs( void );
+
+
+void ackRank_Delivered( char *dept, int alarm, char *ip_addr )
+{
+   ackPhone_t *ph;
+
+   pthread_mutex_lock( &ackRank_mutex );
+   if ( (ph = _ackRank_Find( dept, ip_addr, 1 )) != NULL )
+   {
+      if ( ph->delivered >= ACKRANK_MAX_HISTORY )
+      {
+         ph->delivered /= 2;
+         ph->acks /= 2;
+      }
+      ph->delivered++;
+      ph->last_alarm = alarm;
+      ph->last_ms = _ackRank_NowMs();
+   }
+   pthread_mutex_unlock( &ackRank_mutex );
+}
+
+
+void ackRank_Acked( char *dept, int alarm, char *ip_addr )
+{
+   ackPhone_t *ph;
+   long ms;
+
+   pthread_mutex_lock( &ackRank_mutex );
+   if ( (ph = _ackRank_Find( dept, ip_addr, 0 )) != NULL && ph->last_alarm == alarm && ph->last_ms != 0 )
+   {
+      ms = _ackRank_NowMs() - ph->last_ms;
+      ph->ack_ms = (ph->ack_ms == 0) ? ms : ph->ack_ms + (ms - ph->ack_ms) / 8;
+      ph->acks++;
+      ph->last_ms = 0;                          // one ack per alert
+      Log( DEBUG, "%s: %s acked %s alarm %d in %ld ms (%d of %d)\n", __func__, ip_addr, dept, alarm, ms, ph->acks, ph->delivered );
+   }
+   pthread_mutex_unlock( &ackRank_mutex );
+}
+
+
+int ackRank_Known( char *dept )
+{
+   int i;
+   int n = 0;
+
+   pthread_mutex_lock( &ackRank_mutex );
+   for ( i = 0; i < n_depts; i++ )
+   {
+      if ( strcmp( depts[i].name, dept ) == 0 )
+      {
+         n = depts[i].n_phones;
+         break;
+      }
+   }
+   pthread_mutex_unlock( &ackRank_mutex );
+   return n;
+}
+
+
+double ackRank_Score( char *dept, char *ip_addr )
+{
+   ackPhone_t *ph;
+   double rate = 0.5;
+   long ms = ACKRANK_UNKNOWN_MS;
+
+   pthread_mutex_lock( &ackRank_mutex );
+   if ( (ph = _ackRank_Find( dept, ip_addr, 0 )) != NULL )
+   {
+      rate = (ph->acks + 1.0) / (ph->delivered + 2.0);
+      if ( ph->ack_ms != 0 )
+      {
+         ms = ph->ack_ms;
+      }
+   }
+   pthread_mutex_unlock( &ackRank_mutex );
+
+   return rate * 1000.0 / (ms + 1000.0);
+}
+
+
+/*-----------------( _ackRank_Find )----------------------------
+
+  Find a phone's history for a department.  If create is set and it
+  isn't there, it is added.  ackRank_mutex must be held.
+
+  Returns history, NULL if not found (or no room)
+-------------------------------------------------------------*/
+
+ackPhone_t *_ackRank_Find( char *dept, char *ip_addr, int create )
+{
+   ackPhone_t *tab;
+   int d;
+   int lo, hi, mid, cmp;
+
+   for ( d = 0; d < n_depts && strcmp( depts[d].name, dept ) != 0; d++ );
+   if ( d == n_depts )
+   {
+      if ( !create || n_depts == ACKRANK_MAX_DEPTS || (depts[d].name = strdup( dept )) == NULL )
+      {
+         return NULL;
+      }
+      n_depts++;
+   }
+
+   // binary search for phone
+   lo = 0;
+   hi = depts[d].n_phones - 1;
+   while ( lo <= hi )
+   {
+      mid = (lo + hi) / 2;
+      if ( (cmp = strcmp( ip_addr, depts[d].phones[mid].ip_addr )) == 0 )
+      {
+         return &depts[d].phones[mid];
+      }
+      if ( cmp < 0 )
+      {
+         hi = mid - 1;
+      }
+      else
+      {
+         lo = mid + 1;
+      }
+   }
+
+   if ( !create )
+   {
+      return NULL;
+   }
+
+   if ( depts[d].n_phones == depts[d].max_phones )
+   {
+      if ( (tab = realloc( depts[d].phones, (depts[d].max_phones + 32) * sizeof( ackPhone_t ))) == NULL )
+      {
+         Log( ERROR, "%s: Can't grow ack history for \"%s\"!\n", __func__, dept );
+         return NULL;
+      }
+      depts[d].phones = tab;
+      depts[d].max_phones += 32;
+   }
+
+   // new phone goes at lo
+   memmove( &depts[d].phones[lo+1], &depts[d].phones[lo], (depts[d].n_phones - lo) * sizeof( ackPhone_t ));
+   memset( &depts[d].phones[lo], 0, sizeof( ackPhone_t ));
+   strncpy( depts[d].phones[lo].ip_addr, ip_addr, MAX_IP_ADDR );
+   depts[d].phones[lo].last_alarm = -1;
+   depts[d].n_phones++;
+   return &depts[d].phones[lo];
+}
+
+
+long _ackRank_NowMs( void )
+{
+   struct timespec ts;
+
+   clock_gettime( CLOCK_MONOTONIC, &ts );
+   return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
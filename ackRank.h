@@ -0,0 +1,35 @@
+/**
+ *  @file   ackRank.h
+ *  @author Ron Weiland, Indyme Solutions
+ *  @date   4/17/15
+ *  @brief  Phone ack history, header file
+ *
+ *  @section Description
+ *
+ * Keeps how often, and how fast, each phone acks the alerts of each
+ * department, so an alert can go to the likeliest phones first.
+ *
+ */
+
+#ifndef _ACKRANK_H_
+#define _ACKRANK_H_
+
+#define ACKRANK_MAX_DEPTS    32        // max departments with history
+#define ACKRANK_MAX_HISTORY  50        // alerts remembered per phone (older ones count half)
+
+void ackRank_Delivered( char *dept, int alarm, char *ip_addr );   // phone took an alert
+void ackRank_Acked( char *dept, int alarm, char *ip_addr );       // phone acked an alarm
+int ackRank_Known( char *dept );                                  // phones with history for department
+
+/** @brief Rank a phone for a department's alerts
+ *
+ * Ack rate (with one ack and one miss assumed, so phones with little
+ * history sit in the middle) divided by the smoothed time to ack.
+ *
+ * @param dept Department name
+ * @param ip_addr Phone IP address
+ * @return Score, higher is likelier to ack soon
+ */
+double ackRank_Score( char *dept, char *ip_addr );
+
+#endif
@@ -0,0 +1,167 @@
+/**
+ *  @file   deptSub.c
+ *  @author Ron Weiland, Indyme Solutions
+ *  @date   4/16/15
+ *  @brief  Department subscriptions
+ *
+ *  @section Description
+ *
+ * Alerts for a department only go to the phones that cover it.\n
+ * Each department in the [departments] section of the config lists
+ * line numbers, line number ranges, phone IP addresses, or names of
+ * groups from the [line_groups] section:
+ *
+ *    [departments]
+ *    Electrical = 101-104, 120
+ *    Plumbing = 110, managers
+ *
+ *    [line_groups]
+ *    managers = 130-132
+ *
+ * Departments not listed go to every phone.  Once an alarm escalates to
+ * dept_widen_level (in [phones]) it goes to every phone too.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "deptSub.h"
+#include "config.h"
+#include "logging.h"
+
+void _deptSub_Parse( deptSub_t *sub, char *list, int nested );
+
+
+int deptSub_Get( char *dept, deptSub_t *sub )
+{
+   char *list;
+
+   sub->n_items = 0;
+   if ( (list = config_readStr( "departments", dept, NULL )) == NULL )
+   {
+      return -1;                       // not listed, all phones
+   }
+
+   _deptSub_Parse( sub, list, 0 );
+   if ( sub->n_items == 0 )
+   {
+      Log( WARN, "%s: No phones listed for department \"%s\"\n", __func__, dept );
+      return -1;
+   }
+   return 0;
+}
+
+
+int deptSub_Match( deptSub_t *sub, SPphone_record_t *phone )
+{
+   int len;
+   int i;
+
+   for ( i = 0; i < sub->n_items; i++ )
+   {
+      if ( *sub->items[i].ip_addr != '\0' )
+      {
+         // whole host, the phone's address may have a port after it
+         len = strlen( sub->items[i].ip_addr );
+         if ( strncmp( sub->items[i].ip_addr, phone->ip_addr, len ) == 0 &&
+              (phone->ip_addr[len] == '\0' || phone->ip_addr[len] == ':') )
+         {
+            return 1;
+         }
+      }
+      else if ( phone->line_number >= sub->items[i].first_line && phone->line_number <= sub->items[i].last_line )
+      {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+
+int deptSub_Present( deptSub_t *sub )
+{
+   SPphone_record_t *phone = NULL;
+   int count = 0;
+
+   while ( (phone = spRec_GetNextRecord( phone )) != NULL )
+   {
+      count += deptSub_Match( sub, phone );
+   }
+   return count;
+}
+
+
+int deptSub_WidenLevel( void )
+{
+   return config_readInt( "phones", "dept_widen_level", 2 );
+}
+
+
+/*-----------------( _deptSub_Parse )----------------------------
+
+  Add the items in a comma separated list to a subscription.
+  Names are looked up in [line_groups] (one level deep).
+
+---------------------------------------------------------------*/
+
+void _deptSub_Parse( deptSub_t *sub, char *list, int nested )
+{
+   char item[40];
+   char *group;
+   int len;
+
+   while ( *list != '\0' )
+   {
+      while ( *list == ',' || isspace( (unsigned char)*list ) )
+      {
+         list++;
+      }
+      for ( len = 0; *list != '\0' && *list != ',' && !isspace( (unsigned char)*list ); list++ )
+      {
+         if ( len < sizeof( item )-1 )
+         {
+            item[len++] = *list;
+         }
+      }
+      item[len] = '\0';
+      if ( len == 0 )
+      {
+         break;
+      }
+
+      if ( sub->n_items == DEPTSUB_MAX_ITEMS )
+      {
+         Log( WARN, "%s: Too many items, \"%s\" ignored. Max is %d\n", __func__, item, DEPTSUB_MAX_ITEMS );
+         continue;
+      }
+
+      if ( strchr( item, '.' ) != NULL )
+      {
+         // phone IP address
+         strncpy( sub->items[ sub->n_items ].ip_addr, item, MAX_IP_ADDR );
+         sub->items[ sub->n_items ].ip_addr[MAX_IP_ADDR] = '\0';
+         sub->n_items++;
+      }
+      else if ( isdigit( (unsigned char)*item ))
+      {
+         // line number or range of them
+         *sub->items[ sub->n_items ].ip_addr = '\0';
+         if ( sscanf( item, "%d-%d", &sub->items[ sub->n_items ].first_line, &sub->items[ sub->n_items ].last_line ) != 2 )
+         {
+            sub->items[ sub->n_items ].last_line = sub->items[ sub->n_items ].first_line;
+         }
+         sub->n_items++;
+      }
+      else if ( !nested && (group = config_readStr( "line_groups", item, NULL )) != NULL )
+      {
+         _deptSub_Parse( sub, group, 1 );
+      }
+      else
+      {
+         Log( WARN, "%s: Unknown line group \"%s\"\n", __func__, item );
+      }
+   }
+}
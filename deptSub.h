@@ -0,0 +1,45 @@
+/**
+ *  @file   deptSub.h
+ *  @author Ron Weiland, Indyme Solutions
+ *  @date   4/16/15
+ *  @brief  Department subscriptions, header file
+ *
+ *  @section Description
+ *
+ * Decides which phones cover a department, from the [departments]
+ * and [line_groups] sections of the config file.
+ *
+ */
+
+#ifndef _DEPTSUB_H_
+#define _DEPTSUB_H_
+
+#include "spRec.h"
+
+#define DEPTSUB_MAX_ITEMS  32          // max line ranges / phones per department
+
+/*--- Phones subscribed to a department ---*/
+typedef struct
+{
+   int n_items;
+   struct
+   {
+      int first_line;                  // line number range (0 if an IP address)
+      int last_line;
+      char ip_addr[MAX_IP_ADDR+1];     // phone IP address ("" if a line range)
+   }items[DEPTSUB_MAX_ITEMS];
+}deptSub_t;
+
+/** @brief Get the phones subscribed to a department
+ *
+ * @param dept Department name
+ * @param sub Filled in with the subscribed lines / phones
+ * @return 0 if department has subscribers, -1 if it isn't listed (all phones get it)
+ */
+int deptSub_Get( char *dept, deptSub_t *sub );
+
+int deptSub_Match( deptSub_t *sub, SPphone_record_t *phone );   // true if phone is subscribed
+int deptSub_Present( deptSub_t *sub );                          // number of subscribed phones registered
+int deptSub_WidenLevel( void );                                 // escalation level that goes to all phones
+
+#endif
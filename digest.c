@@ -0,0 +1,253 @@
+/**
+ *  @file   digest.c
+ *  @author Ron Weiland, Indyme Solutions
+ *  @date   4/8/15
+ *  @brief  HTTP digest authentication
+ *
+ *  @section Description
+ *
+ * Parses digest challenges from the phones and builds Authorization
+ * headers from a cached nonce (RFC 2617, MD5, qop "auth" or none).\n
+ * Once a phone has challenged us, later pushes send the Authorization
+ * header up front with the next nonce count and finish in one round trip.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "digest.h"
+#include "md5.h"
+
+int _digest_NextParam( const char **pptr, char *name, int nlen, char *value, int vlen );
+int _digest_HasToken( const char *list, const char *token );
+
+
+int digest_ParseChallenge( digest_t *dig, const char *hdr, char *username, char *password, int *stale )
+{
+   char name[20];
+   char value[DIGEST_MAX_NONCE];
+   char realm[DIGEST_MAX_REALM] = "";
+   char nonce[DIGEST_MAX_NONCE] = "";
+   char opaque[DIGEST_MAX_NONCE] = "";
+   char buf[200];
+   int qop_auth = 0;
+   int qop_given = 0;
+
+   if ( stale != NULL )
+   {
+      *stale = 0;
+   }
+
+   while ( isspace( (unsigned char)*hdr ) )
+   {
+      hdr++;
+   }
+   if ( strncasecmp( hdr, "Digest", 6 ) != 0 )
+   {
+      return -1;                       // not a digest challenge
+   }
+   hdr += 6;
+
+   while ( _digest_NextParam( &hdr, name, sizeof( name ), value, sizeof( value )) == 0 )
+   {
+      if ( strcasecmp( name, "realm" ) == 0 )
+      {
+         strncpy( realm, value, sizeof( realm )-1 );
+      }
+      else if ( strcasecmp( name, "nonce" ) == 0 )
+      {
+         strncpy( nonce, value, sizeof( nonce )-1 );
+      }
+      else if ( strcasecmp( name, "opaque" ) == 0 )
+      {
+         strncpy( opaque, value, sizeof( opaque )-1 );
+      }
+      else if ( strcasecmp( name, "qop" ) == 0 )
+      {
+         qop_given = 1;
+         qop_auth = _digest_HasToken( value, "auth" );    // "auth" or "auth,auth-int", not just "auth-int"
+      }
+      else if ( strcasecmp( name, "algorithm" ) == 0 )
+      {
+         if ( strcasecmp( value, "MD5" ) != 0 )
+         {
+            return -1;                 // can only do plain MD5
+         }
+      }
+      else if ( strcasecmp( name, "stale" ) == 0 && stale != NULL )
+      {
+         *stale = (strcasecmp( value, "true" ) == 0);
+      }
+   }
+
+   if ( *nonce == '\0' || (qop_given && !qop_auth) )
+   {
+      return -1;
+   }
+
+   // Only recompute HA1 if the realm changed
+   if ( *dig->ha1 == '\0' || strcmp( dig->realm, realm ) != 0 )
+   {
+      snprintf( buf, sizeof( buf ), "%s:%s:%s", username, realm, password );
+      md5_Hex( buf, strlen( buf ), dig->ha1 );
+      strcpy( dig->realm, realm );
+   }
+
+   strcpy( dig->nonce, nonce );
+   strcpy( dig->opaque, opaque );
+   dig->qop_auth = qop_auth;
+   dig->nc = 0;                        // new nonce, start count over
+   return 0;
+}
+
+
+int digest_MakeHeader( digest_t *dig, char *method, char *uri, char *username, char *out, int len )
+{
+   char buf[400];
+   char ha2[33];
+   char response[33];
+   char cnonce[17];
+   char nc[9];
+   int n;
+
+   if ( *dig->nonce == '\0' )
+   {
+      return -1;                       // no nonce cached
+   }
+
+   snprintf( buf, sizeof( buf ), "%s:%s", method, uri );
+   md5_Hex( buf, strlen( buf ), ha2 );
+
+   dig->nc++;
+   snprintf( nc, sizeof( nc ), "%08lx", dig->nc );
+
+   if ( dig->qop_auth )
+   {
+      snprintf( cnonce, sizeof( cnonce ), "%08lx%08lx", random(), random() );
+      snprintf( buf, sizeof( buf ), "%s:%s:%s:%s:auth:%s", dig->ha1, dig->nonce, nc, cnonce, ha2 );
+      md5_Hex( buf, strlen( buf ), response );
+      n = snprintf( out, len, "Authorization: Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", "
+                              "qop=auth, nc=%s, cnonce=\"%s\", response=\"%s\"",
+                    username, dig->realm, dig->nonce, uri, nc, cnonce, response );
+   }
+   else
+   {
+      snprintf( buf, sizeof( buf ), "%s:%s:%s", dig->ha1, dig->nonce, ha2 );
+      md5_Hex( buf, strlen( buf ), response );
+      n = snprintf( out, len, "Authorization: Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", response=\"%s\"",
+                    username, dig->realm, dig->nonce, uri, response );
+   }
+
+   if ( *dig->opaque != '\0' && n < len )
+   {
+      n += snprintf( out + n, len - n, ", opaque=\"%s\"", dig->opaque );
+   }
+
+   return (n < len) ? 0 : -1;
+}
+
+
+/*-----------------( _digest_NextParam )----------------------------
+
+  Get the next name=value pair from a challenge.  Value may be quoted.
+
+  Returns 0 if found, -1 if no more
+----------------------------------------------------------------*/
+
+int _digest_NextParam( const char **pptr, char *name, int nlen, char *value, int vlen )
+{
+   const char *ptr = *pptr;
+   int i;
+
+   while ( isspace( (unsigned char)*ptr ) || *ptr == ',' )
+   {
+      ptr++;
+   }
+
+   for ( i = 0; *ptr != '\0' && *ptr != '=' && !isspace( (unsigned char)*ptr ); ptr++ )
+   {
+      if ( i < nlen-1 )
+      {
+         name[i++] = *ptr;
+      }
+   }
+   name[i] = '\0';
+
+   if ( *ptr != '=' || i == 0 )
+   {
+      return -1;
+   }
+   ptr++;
+
+   i = 0;
+   if ( *ptr == '"' )
+   {
+      for ( ptr++; *ptr != '\0' && *ptr != '"'; ptr++ )
+      {
+         if ( *ptr == '\\' && ptr[1] != '\0' )
+         {
+            ptr++;
+         }
+         if ( i < vlen-1 )
+         {
+            value[i++] = *ptr;
+         }
+      }
+      if ( *ptr == '"' )
+      {
+         ptr++;
+      }
+   }
+   else
+   {
+      for ( ; *ptr != '\0' && *ptr != ',' && !isspace( (unsigned char)*ptr ); ptr++ )
+      {
+         if ( i < vlen-1 )
+         {
+            value[i++] = *ptr;
+         }
+      }
+   }
+   value[i] = '\0';
+
+   *pptr = ptr;
+   return 0;
+}
+
+
+/*-----------------( _digest_HasToken )----------------------------
+
+  Check a comma separated list (e.g. qop="auth,auth-int") for a token.
+  Tokens must match exactly, ignoring case and spaces.
+
+  Returns 1 if found, 0 if not
+----------------------------------------------------------------*/
+
+int _digest_HasToken( const char *list, const char *token )
+{
+   int len = strlen( token );
+   const char *end;
+
+   while ( *list != '\0' )
+   {
+      while ( isspace( (unsigned char)*list ) || *list == ',' )
+      {
+         list++;
+      }
+      end = list;
+      while ( *end != '\0' && *end != ',' && !isspace( (unsigned char)*end ) )
+      {
+         end++;
+      }
+      if ( end - list == len && strncasecmp( list, token, len ) == 0 )
+      {
+         return 1;
+      }
+      list = end;
+   }
+   return 0;
+}
@@ -0,0 +1,58 @@
+/**
+ *  @file   digest.h
+ *  @author Ron Weiland, Indyme Solutions
+ *  @date   4/8/15
+ *  @brief  HTTP digest authentication, header file
+ *
+ *  @section Description
+ *
+ * Parses digest challenges from the phones and builds Authorization
+ * headers from a cached nonce, so pushes can send credentials without
+ * waiting for a 401 challenge first.
+ *
+ */
+
+#ifndef _DIGEST_H_
+#define _DIGEST_H_
+
+#define DIGEST_MAX_REALM   64
+#define DIGEST_MAX_NONCE   128
+
+typedef struct
+{
+   char realm[DIGEST_MAX_REALM];       // realm from challenge
+   char nonce[DIGEST_MAX_NONCE];       // server nonce
+   char opaque[DIGEST_MAX_NONCE];      // opaque value to hand back
+   int qop_auth;                       // server offered qop="auth"
+   unsigned long nc;                   // nonce count (last one used)
+   char ha1[33];                       // MD5(username:realm:password), hex
+}digest_t;
+
+/** @brief Parse a WWW-Authenticate header value into the digest cache
+ *
+ * HA1 is only recomputed if the realm changed.
+ *
+ * @param dig Digest cache to fill in
+ * @param hdr Header value ("Digest realm=..., nonce=...")
+ * @param username User name for HA1
+ * @param password Password for HA1
+ * @param stale Set to non-zero if server said the old nonce was stale (may be NULL)
+ * @return 0 if OK, -1 if not a digest challenge we can answer
+ */
+int digest_ParseChallenge( digest_t *dig, const char *hdr, char *username, char *password, int *stale );
+
+/** @brief Build an Authorization header from the cached nonce
+ *
+ * Bumps the nonce count.
+ *
+ * @param dig Digest cache (must have a nonce)
+ * @param method HTTP method ("POST")
+ * @param uri Request URI ("/push")
+ * @param username User name
+ * @param out Where to put the full "Authorization: Digest ..." header line
+ * @param len Size of out
+ * @return 0 if OK, -1 if no nonce cached or out too small
+ */
+int digest_MakeHeader( digest_t *dig, char *method, char *uri, char *username, char *out, int len );
+
+#endif
@@ -0,0 +1,31 @@
+/**
+ *  @file   md5.h
+ *  @author Ron Weiland, Indyme Solutions
+ *  @date   4/8/15
+ *  @brief  MD5 message digest, header file
+ *
+ *  @section Description
+ *
+ * Small MD5 implementation (RFC 1321) used for HTTP digest authentication.
+ *
+ */
+
+#ifndef _MD5_H_
+#define _MD5_H_
+
+#include <stdint.h>
+
+typedef struct
+{
+   uint32_t state[4];           // A, B, C, D
+   uint64_t count;              // number of bytes hashed
+   unsigned char buf[64];       // partial block
+}md5_ctx_t;
+
+void md5_Init( md5_ctx_t *ctx );
+void md5_Update( md5_ctx_t *ctx, const void *data, int len );
+void md5_Final( md5_ctx_t *ctx, unsigned char digest[16] );
+void md5_Hex( const void *data, int len, char hex[33] );      // one-shot, hex output
+void md5_HexDigest( const unsigned char digest[16], char hex[33] );   // digest to hex
+
+#endif
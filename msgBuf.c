@@ -0,0 +1,124 @@
+/**
+ *  @file   msgBuf.c
+ *  @author Ron Weiland, Indyme Solutions
+ *  @date   4/13/15
+ *  @brief  Reference counted message buffers
+ *
+ *  @section Description
+ *
+ * Messages are rendered once into a msgBuf and handed out by reference.\n
+ * A fan-out holds a reference for as long as any of its pushes are
+ * running, so a new alert or accept can be rendered into its own buffer
+ * while an earlier one is still going out.\n
+ * A gathered buffer is allocated in one block: header, pieces, then the
+ * data that isn't in the base buffer.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "msgBuf.h"
+
+
+msgBuf_t *msgBuf_New( int size )
+{
+   msgBuf_t *buf;
+
+   if ( (buf = malloc( sizeof( msgBuf_t ) + size )) == NULL )
+   {
+      return NULL;
+   }
+   buf->refs = 1;
+   buf->len = 0;
+   buf->size = size;
+   buf->n_iov = 0;
+   buf->iov = NULL;
+   buf->base = NULL;
+   *buf->data = '\0';
+   return buf;
+}
+
+
+msgBuf_t *msgBuf_NewGather( msgBuf_t *base, int n_iov, int size )
+{
+   msgBuf_t *buf;
+
+   if ( (buf = malloc( sizeof( msgBuf_t ) + n_iov * sizeof( struct iovec ) + size )) == NULL )
+   {
+      return NULL;
+   }
+   buf->refs = 1;
+   buf->len = 0;
+   buf->size = size;
+   buf->n_iov = n_iov;
+   buf->iov = (struct iovec *)buf->data;        // data is aligned for pointers
+   buf->base = (base != NULL) ? msgBuf_Ref( base ) : NULL;
+   return buf;
+}
+
+
+void msgBuf_Seal( msgBuf_t *buf )
+{
+   int i;
+
+   if ( buf->n_iov > 0 )
+   {
+      for ( buf->len = 0, i = 0; i < buf->n_iov; i++ )
+      {
+         buf->len += buf->iov[i].iov_len;
+      }
+      return;
+   }
+   buf->data[ buf->size - 1 ] = '\0';           // just in case
+   buf->len = strlen( buf->data );
+}
+
+
+int msgBuf_Read( msgBuf_t *buf, int off, char *out, int len )
+{
+   int n = 0;
+   int piece;
+   int i;
+
+   if ( buf->n_iov == 0 )
+   {
+      n = (off < buf->len) ? buf->len - off : 0;
+      n = (n < len) ? n : len;
+      memcpy( out, buf->data + off, n );
+      return n;
+   }
+
+   for ( i = 0; i < buf->n_iov && n < len; i++ )
+   {
+      piece = buf->iov[i].iov_len;
+      if ( off >= piece )
+      {
+         off -= piece;                          // before the part wanted
+         continue;
+      }
+      piece -= off;
+      piece = (piece < len - n) ? piece : len - n;
+      memcpy( out + n, (char *)buf->iov[i].iov_base + off, piece );
+      n += piece;
+      off = 0;
+   }
+   return n;
+}
+
+
+msgBuf_t *msgBuf_Ref( msgBuf_t *buf )
+{
+   __sync_fetch_and_add( &buf->refs, 1 );
+   return buf;
+}
+
+
+void msgBuf_Unref( msgBuf_t *buf )
+{
+   if ( buf != NULL && __sync_sub_and_fetch( &buf->refs, 1 ) == 0 )
+   {
+      msgBuf_Unref( buf->base );
+      free( buf );
+   }
+}
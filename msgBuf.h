@@ -0,0 +1,81 @@
+/**
+ *  @file   msgBuf.h
+ *  @author Ron Weiland, Indyme Solutions
+ *  @date   4/13/15
+ *  @brief  Reference counted message buffers, header file
+ *
+ *  @section Description
+ *
+ * A rendered message is put in a msgBuf once and never changed after that.
+ * Anything that needs the message takes a reference instead of a copy,
+ * and the buffer is freed when the last reference is dropped.\n
+ * A gathered buffer holds the message as a list of pieces instead of one
+ * string.  Pieces point into another buffer it holds a reference to
+ * (the template text) or into its own data (the substitutions).
+ *
+ */
+
+#ifndef _MSGBUF_H_
+#define _MSGBUF_H_
+
+#include <sys/uio.h>
+
+typedef struct msgBuf_s
+{
+   int refs;                           // number of references held
+   int len;                            // length of message (not counting the '\0')
+   int size;                           // room allocated for data
+   int n_iov;                          // number of pieces if gathered, else 0
+   struct iovec *iov;                  // pieces of a gathered message
+   struct msgBuf_s *base;              // buffer pieces point into (held)
+   char data[];                        // the message, '\0' terminated (pieces and their data if gathered)
+}msgBuf_t;
+
+/** @brief Allocate an empty buffer
+ *
+ * The caller holds the only reference.
+ *
+ * @param size Max size of message, including the '\0'
+ * @return New buffer, or NULL if out of memory
+ */
+msgBuf_t *msgBuf_New( int size );
+
+/** @brief Allocate an empty gathered buffer
+ *
+ * The caller holds the only reference, and fills in iov[0..n_iov-1]
+ * pointing into base, or into the room after the pieces
+ * (msgBuf_GatherData()).
+ *
+ * @param base Buffer pieces may point into (a reference is taken)
+ * @param n_iov Number of pieces
+ * @param size Room for data that isn't in base
+ * @return New buffer, or NULL if out of memory
+ */
+msgBuf_t *msgBuf_NewGather( msgBuf_t *base, int n_iov, int size );
+#define msgBuf_GatherData( buf )  ((char *)((buf)->iov + (buf)->n_iov))    // room for pieces not in base
+
+/** @brief Finish filling in a buffer
+ *
+ * Sets the length from the '\0' terminated data, or the pieces if
+ * gathered.  The buffer must not be changed after this.
+ *
+ * @param buf Buffer that was filled in
+ */
+void msgBuf_Seal( msgBuf_t *buf );
+
+/** @brief Copy part of a message
+ *
+ * Works the same for gathered and plain buffers.
+ *
+ * @param buf Buffer to copy from
+ * @param off Offset in message to start at
+ * @param out Where to copy to
+ * @param len Max bytes to copy
+ * @return Bytes copied (0 at end of message)
+ */
+int msgBuf_Read( msgBuf_t *buf, int off, char *out, int len );
+
+msgBuf_t *msgBuf_Ref( msgBuf_t *buf );         // take another reference, returns buf
+void msgBuf_Unref( msgBuf_t *buf );            // drop a reference, frees on last one (NULL OK)
+
+#endif
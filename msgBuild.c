@@ -1,209 +1,944 @@
-/** 
+/**
  *  @file msgBuild.c
  *  @author Ron Weiland, Indyme Solutions
  *  @date   3/13/15
  *  @brief  phone HTML msg builder
  *
  *  @section Description
- * 
- * 
- * Using HTML template and parameters, creates messages ready to send to phone
+ *
+ *
+ * Using HTML template and parameters, creates messages ready to send to phone.\n
+ * Templates are read once and split into literal text and tokens.  They
+ * are read again when the file's modify time or size changes.  A message
+ * is built in one pass, copying each piece into the output.\n
+ * The values put in for the tokens come in a render context from the
+ * caller, and a template once read is never changed (a new copy is made
+ * when the file changes), so renders can run on any number of threads at
+ * once.  msgBuild_mutex is only held to find a template or a cached
+ * message.\n
+ * The last few messages built into msgBufs are kept, found by the
+ * substitutions the template uses.  Building the same one again (an
+ * alert re-sent, or an accept for the same department) hands back
+ * another reference to it without rendering.\n
+ * With render_iov set, messages are gathered: a list of pieces pointing
+ * into the template text, with only the substitutions copied.\n
+ * When a few recipients need a slightly different message, the body is
+ * gathered once (msgBuild_Share) and each variant only holds the pieces
+ * for the tokens that differ (msgBuild_Variant).
  *
  */
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "msgBuild.h"
-#include "strsub.h"
+#include "msgBuf.h"
 #include "server.h"
 #include "config.h"
 #include "logging.h"
 
-static char alarmStr[10];      // Alarm number string
 static char audio1Str[20];     // name of audio file 1
 static char audio2Str[20];     // name of audio file 2
 static char audio3Str[20];     // name of audio file 3
+static pthread_once_t audio_once = PTHREAD_ONCE_INIT;
 
-static char *barColor;
-static char *server;
-static char *deptName;
-static char *alarmNum = alarmStr;
-static char *audio1 = audio1Str;
-static char *audio2 = audio2Str;
-static char *audio3 = audio3Str;
-static char *levelStr;
-
-typedef struct
+static char *tokens[ MSGBUILD_TOKENS ] =
 {
-   char *match;       // token to match in HTML file
-   char **replace;    // pointer to string to replace with
-}replace_def_t;
-
-replace_def_t replacements[] =
-{
-   {"[COLOR]",  &barColor },         // color of bar to put, top and bottom
-   {"[SERVER]", &server },           // server IP and port
-   {"[DEPT]",   &deptName },         // department name
-   {"[ALARM]",  &alarmNum },         // alarm number
-   {"[LEVEL]",  &levelStr },         // string, based on escalation level
-   {"[AUDIO1]", &audio1 },           // First audio file
-   {"[AUDIO2]", &audio2 },           // Second audio file
-   {"[AUDIO3]", &audio3 },           // Third audio file
-   {NULL,NULL}                       // end of substituion list
+   "[COLOR]",                        // color of bar to put, top and bottom
+   "[SERVER]",                       // server IP and port
+   "[DEPT]",                         // department name
+   "[ALARM]",                        // alarm number
+   "[LEVEL]",                        // string, based on escalation level
+   "[AUDIO1]",                       // First audio file
+   "[AUDIO2]",                       // Second audio file
+   "[AUDIO3]",                       // Third audio file
 };
 
 
-void _msgBuild_buildMsg( char *outbuf, char *template, int maxLen );
-int _msgBuild_ReadTemplate( char *template_fname, char *buf );
-void _msgBuild_ChkAudio( void );
+/*--- Piece of a compiled template ---*/
+typedef struct
+{
+   int token;                   // MSGBUILD_xxx token, -1 if literal text
+   int off;                     // literal: start in template text
+   int len;                     // literal: length
+}tmplSeg_t;
 
 #define MAXFILE 2000            // This is the largest amount of data the phone will accept
 
+struct tmpl_s;
+
+/*--- Template as read once, split into pieces.  Never changed after it is made ---*/
+typedef struct tmplVer_s
+{
+   int refs;                    // number of references held
+   struct tmpl_s *file;         // template file it was read from
+   unsigned int uses;           // bit per token found in it
+   msgBuf_t *text;              // template text (gathered messages hold references)
+   int n_segs;
+   int max_segs;                // room in segs
+   tmplSeg_t *segs;             // pieces, in order (grown as needed)
+}tmplVer_t;
+
+/*--- Template file ---*/
+typedef struct tmpl_s
+{
+   struct tmpl_s *next;
+   char *fname;                 // template file name / path
+   time_t mtime;                // file's modify time when read
+   off_t size;                  // file's size when read
+   time_t checked;              // last time file was looked at
+   tmplVer_t *ver;              // as last read (NULL if not read)
+}tmpl_t;
+
+static tmpl_t *tmpl_head;       // templates used so far
+
+#define CACHE_KEY_LEN 200       // max length of substitutions a cached message is found by
+
+/*--- Rendered message kept for reuse ---*/
+typedef struct
+{
+   msgBuf_t *buf;               // message (cache holds a reference, NULL if entry unused)
+   tmplVer_t *ver;              // template it was built from (held)
+   unsigned long used;          // last time handed out, oldest is replaced first
+   char key[CACHE_KEY_LEN];     // substitutions it was built with
+}cached_t;
+
+static cached_t *cache;         // rendered messages
+static int cache_size = -1;     // number of entries (-1 until read from config)
+static int render_iov;          // build gathered messages instead of flat ones
+static unsigned long cache_clock;
+static char *cache_server;      // server address cached messages were built with (malloced)
+
+static pthread_mutex_t msgBuild_mutex = PTHREAD_MUTEX_INITIALIZER;   // templates and cache
+
+tmplVer_t *_msgBuild_GetTemplate( char *template_fname );
+tmplVer_t *_msgBuild_Compile( tmpl_t *tmpl );
+void _msgBuild_VerUnref( tmplVer_t *ver );
+int _msgBuild_Render( tmplVer_t *ver, msgBuild_ctx_t *ctx, char *outbuf, int bufsize );
+msgBuf_t *_msgBuild_Cached( tmplVer_t *ver, msgBuild_ctx_t *ctx, int bufsize, int gather );
+void _msgBuild_CacheAdd( tmplVer_t *ver, char *key, msgBuf_t *buf );
+msgBuf_t *_msgBuild_Flat( tmplVer_t *ver, msgBuild_ctx_t *ctx, int bufsize );
+msgBuf_t *_msgBuild_Gather( tmplVer_t *ver, msgBuild_ctx_t *ctx, int bufsize );
+int _msgBuild_Key( tmplVer_t *ver, msgBuild_ctx_t *ctx, int gather, char *key, int len );
+char *_msgBuild_Value( msgBuild_ctx_t *ctx, int token );
+void _msgBuild_ReadAudio( void );
+
+#if 0
+/*
+ * Render benchmark.  Builds the same alert n times (default 100000) the
+ * old way (read the file, then one strsub_Replace pass per token) and
+ * from the compiled template, and checks both give the same message.
+ * Then renders from several threads at once, and compares rendering a
+ * message for each of 20 recipients with one shared body and 20 variants.
+ * Link with strsub.o msgBuf.o config.o jconfig.o cJSON.o logging.o -lexpat -lpthread -lm
+ * Usage: msgbench template_file [n] [threads]
+ */
+#include <sys/time.h>
+#include "strsub.h"
+
+char *server_GetOurAddress( void ) { return "192.168.1.138:8080"; }     // server.c stand-in
+
+static char *bench_fname;
+static int bench_n;
 
-int msgBuild_makeAlertMsg( char *template_fname, char *outbuf, int bufsize, char *dept, int alarm_num, int level )
+static double _bench_Secs( void )
 {
+   struct timeval tv;
+
+   gettimeofday( &tv, NULL );
+   return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// The way messages were built before templates were compiled
+static int _bench_OldAlert( char *fname, char *outbuf, char *dept, int alarm_num, int level )
+{
+   msgBuild_ctx_t ctx;
    char template[MAXFILE];
-   char *lnone = "\0";
-   int ret;
+   char tmp[MAXFILE];
+   FILE *fptr;
+   int len;
+   int i;
+
+   if ( (fptr = fopen( fname, "r" )) == NULL )
+   {
+      return -1;
+   }
+   len = fread( template, 1, MAXFILE, fptr );
+   fclose( fptr );
+   template[len] = '\0';
 
-   if ( (ret = _msgBuild_ReadTemplate( template_fname, template )) != 0 )
+   msgBuild_InitAlert( &ctx, dept, alarm_num, level );
+   strcpy( outbuf, template );
+   for ( i = 0; i < MSGBUILD_TOKENS; i++ )
    {
-      return ret;         // reading template failed
+      strsub_Replace( tmp, outbuf, tokens[i], _msgBuild_Value( &ctx, i ));
+      strcpy( outbuf, tmp );
    }
+   return 0;
+}
+
+static void *_bench_Thread( void *arg )
+{
+   char msg[MAXFILE];
+   msgBuild_ctx_t ctx;
+   int i;
+
+   for ( i = 0; i < bench_n; i++ )
+   {
+      msgBuild_InitAlert( &ctx, "Electrical", 100 + i % 10, i % 3 );
+      msgBuild_Render( bench_fname, &ctx, msg, sizeof( msg ));
+   }
+   return NULL;
+}
+
+int main( int argc, char *argv[] )
+{
+   char old_msg[MAXFILE];
+   char new_msg[MAXFILE];
+   char name[20];
+   pthread_t tid[16];
+   msgBuild_ctx_t ctx;
+   msgBuild_ctx_t delta;
+   msgBuild_shared_t sh;
+   msgBuf_t *buf;
+   double t;
+   int n_threads = 4;
+   int i, j;
+
+   if ( argc < 2 )
+   {
+      printf( "Usage: %s template_file [n] [threads]\n", argv[0] );
+      return 1;
+   }
+   bench_fname = argv[1];
+   bench_n = (argc > 2) ? atoi( argv[2] ) : 100000;
+   if ( argc > 3 && atoi( argv[3] ) > 0 && atoi( argv[3] ) <= 16 )
+   {
+      n_threads = atoi( argv[3] );
+   }
+
+   t = _bench_Secs();
+   for ( i = 0; i < bench_n; i++ )
+   {
+      _bench_OldAlert( argv[1], old_msg, "Electrical", 100 + i % 10, i % 3 );
+   }
+   t = _bench_Secs() - t;
+   printf( "read + strsub:    %.2f us per message\n", t * 1000000.0 / bench_n );
+
+   t = _bench_Secs();
+   for ( i = 0; i < bench_n; i++ )
+   {
+      msgBuild_InitAlert( &ctx, "Electrical", 100 + i % 10, i % 3 );
+      msgBuild_Render( argv[1], &ctx, new_msg, sizeof( new_msg ));
+   }
+   t = _bench_Secs() - t;
+   printf( "compiled template: %.2f us per message\n", t * 1000000.0 / bench_n );
+
+   printf( "messages %s\n", strcmp( old_msg, new_msg ) == 0 ? "match" : "DIFFER" );
+
+   t = _bench_Secs();
+   for ( i = 0; i < n_threads; i++ )
+   {
+      pthread_create( &tid[i], NULL, _bench_Thread, NULL );
+   }
+   for ( i = 0; i < n_threads; i++ )
+   {
+      pthread_join( tid[i], NULL );
+   }
+   t = _bench_Secs() - t;
+   printf( "%d threads:         %.2f us per message\n", n_threads, t * 1000000.0 / (bench_n * n_threads) );
+
+   t = _bench_Secs();
+   for ( i = 0; i < bench_n / 20; i++ )
+   {
+      for ( j = 0; j < 20; j++ )
+      {
+         msgBuild_InitAlert( &ctx, "Electrical", 100 + i % 10, 0 );
+         sprintf( name, "Phone %d", j );
+         ctx.vals[ MSGBUILD_LEVEL ] = name;
+         msgBuf_Unref( _msgBuild_Flat( tmpl_head->ver, &ctx, MAXFILE ));      // each into its own buffer
+      }
+   }
+   t = _bench_Secs() - t;
+   printf( "20 full renders:   %.2f us per recipient\n", t * 1000000.0 / (bench_n / 20 * 20) );
+
+   t = _bench_Secs();
+   for ( i = 0; i < bench_n / 20; i++ )
+   {
+      msgBuild_InitAlert( &ctx, "Electrical", 100 + i % 10, 0 );
+      msgBuild_Share( &sh, bench_fname, &ctx, MAXFILE );
+      memset( &delta, 0, sizeof( delta ));
+      for ( j = 0; j < 20; j++ )
+      {
+         sprintf( name, "Phone %d", j );
+         delta.vals[ MSGBUILD_LEVEL ] = name;
+         buf = msgBuild_Variant( &sh, &delta );
+         msgBuf_Unref( buf );
+      }
+      msgBuild_Unshare( &sh );
+   }
+   t = _bench_Secs() - t;
+   printf( "body + 20 variants: %.2f us per recipient\n", t * 1000000.0 / (bench_n / 20 * 20) );
+   return 0;
+}
+#endif
+
+
+void msgBuild_InitAlert( msgBuild_ctx_t *ctx, char *dept, int alarm_num, int level )
+{
+   msgBuild_InitAccept( ctx, dept, alarm_num, "" );
 
    switch( level )
    {
       case 0:
-         levelStr = lnone;                    // no "Request" message
-         barColor = "green";
+         ctx->vals[ MSGBUILD_LEVEL ] = "";             // no "Request" message
+         ctx->vals[ MSGBUILD_COLOR ] = "green";
          break;
       case 1:
-         levelStr = "2nd Request";
-         barColor = "yellow";
+         ctx->vals[ MSGBUILD_LEVEL ] = "2nd Request";
+         ctx->vals[ MSGBUILD_COLOR ] = "yellow";
          break;
       case 2:
       default:
-         levelStr = "3rd Request";
-         barColor = "red";
+         ctx->vals[ MSGBUILD_LEVEL ] = "3rd Request";
+         ctx->vals[ MSGBUILD_COLOR ] = "red";
          break;
    }
-   deptName = dept;
-   sprintf(alarmStr, "%d", alarm_num);      // get alarm number as string
-   server = server_GetOurAddress();         // get system address:port
+}
 
-   _msgBuild_buildMsg( outbuf, template, MAXFILE );
 
-   Log( DEBUG, "%s: Message size: %d\n", __func__, (int)strlen( outbuf ) );
-   return 0;
+void msgBuild_InitAccept( msgBuild_ctx_t *ctx, char *dept, int alarm_num, char *msg )
+{
+   pthread_once( &audio_once, _msgBuild_ReadAudio );      // Make sure audio file names have been read from config
+
+   memset( ctx, 0, sizeof( msgBuild_ctx_t ));
+   if ( alarm_num >= 0 )
+   {
+      snprintf( ctx->alarm_str, sizeof( ctx->alarm_str ), "%d", alarm_num );   // get alarm number as string
+      ctx->vals[ MSGBUILD_ALARM ] = ctx->alarm_str;
+   }
+   ctx->vals[ MSGBUILD_COLOR ] = "green";                 // alarm taken care of
+   ctx->vals[ MSGBUILD_DEPT ] = dept;
+   ctx->vals[ MSGBUILD_LEVEL ] = msg;
+   ctx->vals[ MSGBUILD_SERVER ] = server_GetOurAddress();     // get system address:port
+   ctx->vals[ MSGBUILD_AUDIO1 ] = audio1Str;
+   ctx->vals[ MSGBUILD_AUDIO2 ] = audio2Str;
+   ctx->vals[ MSGBUILD_AUDIO3 ] = audio3Str;
 }
 
 
+int msgBuild_Render( char *template_fname, msgBuild_ctx_t *ctx, char *outbuf, int bufsize )
+{
+   tmplVer_t *ver;
+   int len;
+
+   if ( (ver = _msgBuild_GetTemplate( template_fname )) == NULL )
+   {
+      return -1;         // reading template failed
+   }
+
+   len = _msgBuild_Render( ver, ctx, outbuf, bufsize );
+   _msgBuild_VerUnref( ver );
+   return len;
+}
+
 
-int msgBuild_makeAcceptMsg( char *template_fname, char *outbuf, int bufsize, char *dept, char *msg )
+msgBuf_t *msgBuild_RenderBuf( char *template_fname, msgBuild_ctx_t *ctx, int bufsize )
 {
-   char template[MAXFILE];
-   int ret;
+   tmplVer_t *ver;
+   msgBuf_t *buf;
 
-   if ( (ret = _msgBuild_ReadTemplate( template_fname, template )) != 0 )
+   if ( (ver = _msgBuild_GetTemplate( template_fname )) == NULL )
    {
-      return ret;         // reading template failed
+      return NULL;       // reading template failed
    }
 
-   deptName = dept;
-   levelStr = msg;
-   server = server_GetOurAddress();         // get system address:port
+   buf = _msgBuild_Cached( ver, ctx, bufsize, 0 );
+   _msgBuild_VerUnref( ver );
+   return buf;
+}
 
-   _msgBuild_buildMsg( outbuf, template, MAXFILE );
 
-//   printf( "%s\n", outbuf );
-   Log( DEBUG, "%s: Message size: %d\n", __func__, (int)strlen( outbuf ) );
+int msgBuild_Share( msgBuild_shared_t *sh, char *template_fname, msgBuild_ctx_t *ctx, int bufsize )
+{
+   memset( sh, 0, sizeof( msgBuild_shared_t ));
+   if ( (sh->ver = _msgBuild_GetTemplate( template_fname )) == NULL )
+   {
+      return -1;         // reading template failed
+   }
+
+   if ( (sh->body = _msgBuild_Cached( sh->ver, ctx, bufsize, 1 )) == NULL )
+   {
+      msgBuild_Unshare( sh );
+      return -1;
+   }
+   sh->bufsize = bufsize;
    return 0;
+}
+
+
+/*-------------------------( msgBuild_Variant )-------------------------
+
+  Make a copy of a shared body with some tokens changed.  The pieces
+  for those tokens point into the new buffer, the rest are the body's
+  own pieces (the new buffer holds the body).
+
+  Returns message (caller holds a reference), NULL if error or too big
+---------------------------------------------------------------------*/
+
+msgBuf_t *msgBuild_Variant( msgBuild_shared_t *sh, msgBuild_ctx_t *delta )
+{
+   tmplVer_t *ver = sh->ver;
+   msgBuf_t *body = sh->body;
+   msgBuf_t *buf;
+   tmplSeg_t *seg;
+   char *frag;
+   int room = 0;
+   int len;
+   int i;
+
+   for ( i = 0, seg = ver->segs; i < ver->n_segs; i++, seg++ )
+   {
+      if ( seg->token >= 0 && delta->vals[ seg->token ] != NULL )
+      {
+         room += strlen( delta->vals[ seg->token ] );
+      }
+   }
+
+   if ( (buf = msgBuf_NewGather( body, body->n_iov, room + 1 )) == NULL )
+   {
+      Log( ERROR, "%s: Can't malloc message!\n", __func__ );
+      return NULL;
+   }
+
+   frag = msgBuf_GatherData( buf );
+   for ( i = 0, seg = ver->segs; i < ver->n_segs; i++, seg++ )
+   {
+      if ( seg->token >= 0 && delta->vals[ seg->token ] != NULL )
+      {
+         len = strlen( delta->vals[ seg->token ] );
+         memcpy( frag, delta->vals[ seg->token ], len );
+         buf->iov[i].iov_base = frag;
+         buf->iov[i].iov_len = len;
+         frag += len;
+      }
+      else
+      {
+         buf->iov[i] = body->iov[i];        // same as everyone else's
+      }
+   }
+   *frag = '\0';
+   msgBuf_Seal( buf );
+
+   if ( buf->len > sh->bufsize - 1 )
+   {
+      Log( ERROR, "%s: Message from \"%s\" is over %d bytes\n", __func__, ver->file->fname, sh->bufsize - 1 );
+      msgBuf_Unref( buf );
+      return NULL;
+   }
+   return buf;
+}
 
+
+void msgBuild_Unshare( msgBuild_shared_t *sh )
+{
+   msgBuf_Unref( sh->body );
+   _msgBuild_VerUnref( sh->ver );
+   sh->body = NULL;
+   sh->ver = NULL;
 }
 
-void _msgBuild_buildMsg( char *outbuf, char *template, int maxLen )
+
+msgBuf_t *msgBuild_AlertBuf( char *template_fname, int bufsize, char *dept, int alarm_num, int level )
 {
-   char buf2[ maxLen ];
-   char *orig = template;
-   char *dest = buf2;
-   char *tptr;
-   int first = 1;
-   replace_def_t *rptr = replacements;
+   msgBuild_ctx_t ctx;
+
+   msgBuild_InitAlert( &ctx, dept, alarm_num, level );
+   return msgBuild_RenderBuf( template_fname, &ctx, bufsize );
+}
+
 
-   _msgBuild_ChkAudio();                // Make sure audio file names have been read from config
+/*-------------------------( _msgBuild_Cached )-------------------------
 
-   while( rptr->match != NULL )
+  Get the message for the context's substitutions from the cache, or
+  render it and keep it there.  Entries from an older version of the
+  template are dropped, and all of them are when the server address
+  changes.  Rendering is done without msgBuild_mutex held.
+  If gather is set the message must be gathered, one piece per piece
+  of the template.  Gathered and flat copies are cached separately.
+
+  Returns message (caller holds a reference), NULL if error
+---------------------------------------------------------------------*/
+
+msgBuf_t *_msgBuild_Cached( tmplVer_t *ver, msgBuild_ctx_t *ctx, int bufsize, int gather )
+{
+   msgBuf_t *buf = NULL;
+   cached_t *c;
+   char key[CACHE_KEY_LEN];
+   char *server = _msgBuild_Value( ctx, MSGBUILD_SERVER );
+   int keyed;
+   int i;
+
+   pthread_mutex_lock( &msgBuild_mutex );
+   if ( cache_size < 0 )
    {
-      strsub_Replace( dest, orig, rptr->match, *rptr->replace );     // replace matches in message
+      render_iov = config_readInt( "phones", "render_iov", 0 );
+      cache_size = config_readInt( "phones", "render_cache", 32 );
+      if ( cache_size > 0 && (cache = calloc( cache_size, sizeof( cached_t ))) == NULL )
+      {
+         Log( ERROR, "%s: Can't malloc message cache!\n", __func__ );
+         cache_size = 0;
+      }
+   }
+
+   if ( cache_server == NULL || strcmp( server, cache_server ) != 0 )
+   {
+      for ( i = 0; i < cache_size; i++ )
+      {
+         msgBuf_Unref( cache[i].buf );      // built with the old address
+         _msgBuild_VerUnref( cache[i].ver );
+         cache[i].buf = NULL;
+         cache[i].ver = NULL;
+         cache[i].used = 0;
+      }
+      free( cache_server );
+      cache_server = strdup( server );    // if out of memory, flushed again next time
+   }
 
-      if ( first )
+   gather = (gather || render_iov);
+   keyed = (cache_size > 0 && _msgBuild_Key( ver, ctx, gather, key, sizeof( key )) == 0);
+   for ( i = 0; keyed && i < cache_size; i++ )
+   {
+      c = &cache[i];
+      if ( c->buf != NULL && c->ver->file == ver->file )
       {
-         orig = outbuf;                 // only use template on first pass
-         first = 0;
+         if ( c->ver != ver->file->ver )
+         {
+            msgBuf_Unref( c->buf );         // template changed since
+            _msgBuild_VerUnref( c->ver );
+            c->buf = NULL;
+            c->ver = NULL;
+            c->used = 0;
+         }
+         else if ( c->ver == ver && strcmp( c->key, key ) == 0 )
+         {
+            c->used = ++cache_clock;
+            buf = msgBuf_Ref( c->buf );
+            break;
+         }
       }
+   }
+   pthread_mutex_unlock( &msgBuild_mutex );
 
-      // ping-pong buffers
-      tptr = dest; dest = orig; orig = tptr;
-      rptr++;
+   if ( buf != NULL )
+   {
+      return buf;
    }
 
-   if ( orig != outbuf )
+   if ( (buf = gather ? _msgBuild_Gather( ver, ctx, bufsize ) : _msgBuild_Flat( ver, ctx, bufsize )) == NULL )
    {
-      strcpy( outbuf, buf2 );         // move to output
+      return NULL;
    }
+   Log( DEBUG, "%s: Message size: %d, %d pieces\n", __func__, buf->len, buf->n_iov );
+
+   if ( keyed )
+   {
+      _msgBuild_CacheAdd( ver, key, buf );
+   }
+   return buf;
 }
 
-// Read in the given template file
 
-int _msgBuild_ReadTemplate( char *template_fname, char *buf )
+// Keep a message in the cache, in place of the one used longest ago
+
+void _msgBuild_CacheAdd( tmplVer_t *ver, char *key, msgBuf_t *buf )
 {
-   FILE *fptr;
+   cached_t *lru = &cache[0];
+   int i;
+
+   pthread_mutex_lock( &msgBuild_mutex );
+   for ( i = 1; i < cache_size; i++ )
+   {
+      if ( cache[i].used < lru->used )
+      {
+         lru = &cache[i];
+      }
+   }
+
+   msgBuf_Unref( lru->buf );
+   _msgBuild_VerUnref( lru->ver );
+   lru->buf = msgBuf_Ref( buf );
+   lru->ver = ver;
+   __sync_fetch_and_add( &ver->refs, 1 );
+   lru->used = ++cache_clock;
+   strcpy( lru->key, key );
+   pthread_mutex_unlock( &msgBuild_mutex );
+}
+
+
+// Render a message into its own buffer
+
+msgBuf_t *_msgBuild_Flat( tmplVer_t *ver, msgBuild_ctx_t *ctx, int bufsize )
+{
+   msgBuf_t *buf;
+
+   if ( (buf = msgBuf_New( bufsize )) == NULL )
+   {
+      Log( ERROR, "%s: Can't malloc message!\n", __func__ );
+      return NULL;
+   }
+   if ( _msgBuild_Render( ver, ctx, buf->data, bufsize ) < 0 )
+   {
+      msgBuf_Unref( buf );
+      return NULL;
+   }
+   msgBuf_Seal( buf );
+   return buf;
+}
+
+
+/*-------------------------( _msgBuild_Gather )-------------------------
+
+  Build a gathered message: literal pieces point into the template
+  text, only the substitutions are copied.
+
+  Returns message (caller holds a reference), NULL if error or too big
+---------------------------------------------------------------------*/
+
+msgBuf_t *_msgBuild_Gather( tmplVer_t *ver, msgBuild_ctx_t *ctx, int bufsize )
+{
+   msgBuf_t *buf;
+   tmplSeg_t *seg;
+   char *frag;
+   char *src;
+   int room = 0;
    int len;
+   int i;
 
-   if ( (fptr = fopen( template_fname, "r" )) == NULL )
+   for ( i = 0, seg = ver->segs; i < ver->n_segs; i++, seg++ )
    {
-      printf( "Can't open file \"%s\"\n", template_fname );
-      return -1;
+      if ( seg->token >= 0 )
+      {
+         room += strlen( _msgBuild_Value( ctx, seg->token ));
+      }
    }
 
-   // Read in the template file to use
-   len = fread( buf, 1, MAXFILE, fptr );     // read in the form
-   if ( len >= MAXFILE )
+   if ( (buf = msgBuf_NewGather( ver->text, ver->n_segs, room + 1 )) == NULL )
    {
-      printf( "file \"%s\" is too long.  Can't be over %d bytes\n", template_fname, MAXFILE );
-      fclose( fptr );
-      return -1;
+      Log( ERROR, "%s: Can't malloc message!\n", __func__ );
+      return NULL;
    }
-   buf[len] = '\0';                         // null-terminate the template string
-   fclose( fptr );
 
+   frag = msgBuf_GatherData( buf );
+   for ( i = 0, seg = ver->segs; i < ver->n_segs; i++, seg++ )
+   {
+      if ( seg->token < 0 )
+      {
+         buf->iov[i].iov_base = ver->text->data + seg->off;
+         buf->iov[i].iov_len = seg->len;
+      }
+      else
+      {
+         src = _msgBuild_Value( ctx, seg->token );
+         len = strlen( src );
+         memcpy( frag, src, len );
+         buf->iov[i].iov_base = frag;
+         buf->iov[i].iov_len = len;
+         frag += len;
+      }
+   }
+   *frag = '\0';
+   msgBuf_Seal( buf );
+
+   if ( buf->len > bufsize - 1 )
+   {
+      Log( ERROR, "%s: Message from \"%s\" is over %d bytes\n", __func__, ver->file->fname, bufsize - 1 );
+      msgBuf_Unref( buf );
+      return NULL;
+   }
+   return buf;
+}
+
+
+/*-------------------------( _msgBuild_Key )-------------------------
+
+  Make the cache key from the render mode (gathered or flat) and the
+  substitutions the template uses
+
+  Returns 0 if OK, -1 if too long to cache
+------------------------------------------------------------------*/
+
+int _msgBuild_Key( tmplVer_t *ver, msgBuild_ctx_t *ctx, int gather, char *key, int len )
+{
+   int n;
+   int i;
+
+   if ( len < 2 )
+   {
+      return -1;
+   }
+   *key++ = gather ? 'G' : 'F';
+   *key = '\0';
+   len--;
+   for ( i = 0; i < MSGBUILD_TOKENS; i++ )
+   {
+      if ( ver->uses & (1 << i) )
+      {
+         if ( (n = snprintf( key, len, "%s\n", _msgBuild_Value( ctx, i ))) >= len )
+         {
+            return -1;
+         }
+         key += n;
+         len -= n;
+      }
+   }
    return 0;
 }
 
 
-// Check the audio messages from the config file
+/*-------------------------( _msgBuild_GetTemplate )-------------------------
+
+  Get a compiled template.  Read from the file the first time, after
+  that only if the file's modify time or size changed (checked at most
+  once a second).
 
-void _msgBuild_ChkAudio( void )
+  Returns template (caller holds a reference), NULL if it can't be read
+--------------------------------------------------------------------------*/
+
+tmplVer_t *_msgBuild_GetTemplate( char *template_fname )
 {
-   char *str;
+   tmpl_t *tmpl;
+   tmplVer_t *ver = NULL;
+   struct stat st;
+   time_t now = time( NULL );
+
+   pthread_mutex_lock( &msgBuild_mutex );
+   for ( tmpl = tmpl_head; tmpl != NULL && strcmp( tmpl->fname, template_fname ) != 0; tmpl = tmpl->next );
+
+   if ( tmpl != NULL && tmpl->ver != NULL && tmpl->checked == now )
+   {
+      ver = tmpl->ver;                      // looked at it this second
+   }
+   else if ( stat( template_fname, &st ) != 0 )
+   {
+      Log( ERROR, "%s: Can't open file \"%s\"\n", __func__, template_fname );
+   }
+   else
+   {
+      if ( tmpl == NULL )
+      {
+         if ( (tmpl = calloc( 1, sizeof( tmpl_t ))) == NULL || (tmpl->fname = strdup( template_fname )) == NULL )
+         {
+            Log( ERROR, "%s: Can't malloc template \"%s\"!\n", __func__, template_fname );
+            free( tmpl );
+            pthread_mutex_unlock( &msgBuild_mutex );
+            return NULL;
+         }
+         tmpl->next = tmpl_head;
+         tmpl_head = tmpl;
+      }
+
+      tmpl->checked = now;
+      if ( tmpl->ver != NULL && tmpl->mtime == st.st_mtime && tmpl->size == st.st_size )
+      {
+         ver = tmpl->ver;                   // not changed
+      }
+      else if ( (ver = _msgBuild_Compile( tmpl )) != NULL )
+      {
+         _msgBuild_VerUnref( tmpl->ver );   // renders still using the old one keep it
+         tmpl->ver = ver;
+         tmpl->mtime = st.st_mtime;
+         tmpl->size = st.st_size;
+         Log( DEBUG, "%s: Read \"%s\", %d pieces\n", __func__, template_fname, ver->n_segs );
+      }
+   }
+
+   if ( ver != NULL )
+   {
+      __sync_fetch_and_add( &ver->refs, 1 );
+   }
+   pthread_mutex_unlock( &msgBuild_mutex );
+   return ver;
+}
+
+
+/*-------------------------( _msgBuild_Compile )-------------------------
+
+  Read a template file and split it into literal text and tokens
+
+  Returns new template (one reference), NULL if can't read or too big
+----------------------------------------------------------------------*/
+
+tmplVer_t *_msgBuild_Compile( tmpl_t *tmpl )
+{
+   FILE *fptr;
+   tmplVer_t *ver;
+   tmplSeg_t *segs;
+   char *ptr;
+   char *lit;
+   int len;
+   int i;
+
+   if ( (fptr = fopen( tmpl->fname, "r" )) == NULL )
+   {
+      Log( ERROR, "%s: Can't open file \"%s\"\n", __func__, tmpl->fname );
+      return NULL;
+   }
+   if ( (ver = calloc( 1, sizeof( tmplVer_t ))) == NULL || (ver->text = msgBuf_New( MAXFILE )) == NULL )
+   {
+      Log( ERROR, "%s: Can't malloc template \"%s\"!\n", __func__, tmpl->fname );
+      free( ver );
+      fclose( fptr );
+      return NULL;
+   }
+   ver->refs = 1;
+   ver->file = tmpl;
 
-   if ( *audio1Str == '\0' )     // Not read from config yet?
+   // Read in the template file to use
+   len = fread( ver->text->data, 1, MAXFILE, fptr );     // read in the form
+   fclose( fptr );
+   if ( len >= MAXFILE )
    {
-      str = config_readStr( "phones", "audio1", "audio1.wav" );
-      strncpy( audio1Str, str, sizeof( audio1Str ) );
+      Log( ERROR, "%s: file \"%s\" is too long.  Can't be over %d bytes\n", __func__, tmpl->fname, MAXFILE );
+      _msgBuild_VerUnref( ver );
+      return NULL;
+   }
+   ver->text->data[len] = '\0';                          // null-terminate the template string
+   msgBuf_Seal( ver->text );
+
+   lit = ptr = ver->text->data;
+   while ( ptr != NULL )
+   {
+      if ( (ptr = strchr( ptr, '[' )) != NULL )
+      {
+         for ( i = 0; i < MSGBUILD_TOKENS && strncmp( ptr, tokens[i], strlen( tokens[i] )) != 0; i++ );
+         if ( i == MSGBUILD_TOKENS )
+         {
+            ptr++;                                  // not one of ours, leave it
+            continue;
+         }
+      }
+
+      if ( ver->n_segs + 2 > ver->max_segs )
+      {
+         len = (ver->max_segs == 0) ? 32 : ver->max_segs * 2;
+         if ( (segs = realloc( ver->segs, len * sizeof( tmplSeg_t ))) == NULL )
+         {
+            Log( ERROR, "%s: Can't malloc pieces of template \"%s\"!\n", __func__, tmpl->fname );
+            _msgBuild_VerUnref( ver );
+            return NULL;
+         }
+         ver->segs = segs;
+         ver->max_segs = len;
+      }
+
+      // text up to the token (or the end)
+      len = (ptr != NULL) ? ptr - lit : strlen( lit );
+      if ( len != 0 )
+      {
+         ver->segs[ ver->n_segs ].token = -1;
+         ver->segs[ ver->n_segs ].off = lit - ver->text->data;
+         ver->segs[ ver->n_segs ].len = len;
+         ver->n_segs++;
+      }
+
+      if ( ptr != NULL )
+      {
+         ver->segs[ ver->n_segs ].token = i;
+         ver->n_segs++;
+         ver->uses |= 1 << i;
+         ptr += strlen( tokens[i] );
+         lit = ptr;
+      }
    }
 
-   if ( *audio2Str == '\0' )     // Not read from config yet?
+   return ver;
+}
+
+
+// Drop a reference to a template, free it on the last one (NULL OK)
+
+void _msgBuild_VerUnref( tmplVer_t *ver )
+{
+   if ( ver != NULL && __sync_sub_and_fetch( &ver->refs, 1 ) == 0 )
    {
-      str = config_readStr( "phones", "audio2", "audio2.wav" );
-      strncpy( audio2Str, str, sizeof( audio2Str ) );
+      msgBuf_Unref( ver->text );
+      free( ver->segs );
+      free( ver );
    }
+}
+
+
+/*-------------------------( _msgBuild_Render )-------------------------
 
-   if ( *audio3Str == '\0' )     // Not read from config yet?
+  Build a message from a compiled template in one pass
+
+  Returns length of message, -1 if it doesn't fit in outbuf
+---------------------------------------------------------------------*/
+
+int _msgBuild_Render( tmplVer_t *ver, msgBuild_ctx_t *ctx, char *outbuf, int bufsize )
+{
+   tmplSeg_t *seg;
+   char *src;
+   char *out = outbuf;
+   int left = bufsize - 1;                  // room for the null
+   int len;
+   int i;
+
+   for ( i = 0, seg = ver->segs; i < ver->n_segs; i++, seg++ )
    {
-      str = config_readStr( "phones", "audio3", "audio3.wav" );
-      strncpy( audio3Str, str, sizeof( audio3Str ) );
+      if ( seg->token < 0 )
+      {
+         src = ver->text->data + seg->off;
+         len = seg->len;
+      }
+      else
+      {
+         src = _msgBuild_Value( ctx, seg->token );
+         len = strlen( src );
+      }
+
+      if ( len > left )
+      {
+         Log( ERROR, "%s: Message from \"%s\" is over %d bytes\n", __func__, ver->file->fname, bufsize - 1 );
+         *outbuf = '\0';
+         return -1;
+      }
+      memcpy( out, src, len );
+      out += len;
+      left -= len;
    }
+   *out = '\0';
+
+   return out - outbuf;
+}
+
+
+// Value of a token in a render context ("" if not set)
+
+char *_msgBuild_Value( msgBuild_ctx_t *ctx, int token )
+{
+   return (ctx->vals[ token ] != NULL) ? ctx->vals[ token ] : "";
+}
+
+
+// Read the audio file names from the config file (once)
+
+void _msgBuild_ReadAudio( void )
+{
+   char *str;
+
+   str = config_readStr( "phones", "audio1", "audio1.wav" );
+   strncpy( audio1Str, str, sizeof( audio1Str )-1 );
+
+   str = config_readStr( "phones", "audio2", "audio2.wav" );
+   strncpy( audio2Str, str, sizeof( audio2Str )-1 );
+
+   str = config_readStr( "phones", "audio3", "audio3.wav" );
+   strncpy( audio3Str, str, sizeof( audio3Str )-1 );
 }
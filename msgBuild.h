@@ -7,7 +7,9 @@
  *  @section Description
  * 
  * 
- * Using HTML template and parameters, creates messages ready to send to phone
+ * Using HTML template and parameters, creates messages ready to send to phone.
+ * Token values are passed in a render context, so messages can be built
+ * on several threads at once.
  *
  */
 
@@ -15,26 +17,121 @@
 #ifndef _MSGBUILD_H_
 #define _MSGBUILD_H_
 
-/** @brief Creates HTML alert message from template and data ready to send to phone
+#include "msgBuf.h"
+
+// Tokens a template may hold
+#define MSGBUILD_COLOR    0       // [COLOR]  color of bar to put, top and bottom
+#define MSGBUILD_SERVER   1       // [SERVER] server IP and port
+#define MSGBUILD_DEPT     2       // [DEPT]   department name
+#define MSGBUILD_ALARM    3       // [ALARM]  alarm number
+#define MSGBUILD_LEVEL    4       // [LEVEL]  string, based on escalation level
+#define MSGBUILD_AUDIO1   5       // [AUDIO1] First audio file
+#define MSGBUILD_AUDIO2   6       // [AUDIO2] Second audio file
+#define MSGBUILD_AUDIO3   7       // [AUDIO3] Third audio file
+#define MSGBUILD_TOKENS   8       // number of tokens
+
+/*--- What to put in for each token, one per render (don't copy, vals point into it) ---*/
+typedef struct
+{
+   char *vals[ MSGBUILD_TOKENS ];      // value of each token (NULL puts in nothing)
+   char alarm_str[12];                 // alarm number as string
+}msgBuild_ctx_t;
+
+/** @brief Set up a render context for an alert
  *
- * @param template_fname Name of alert template file
- * @param outbuf Location to put completed message
- * @param bufsize Size of outbuf data area
- * @param dept Pointer to department name
+ * Values may be changed in ctx->vals before rendering.
+ *
+ * @param ctx Context to fill in
+ * @param dept Pointer to department name (must last until rendered)
  * @param alarm_num Alarm number
- * @param level Alarm Escalation level
- * @return 0 if OK, non-zero if error
+ * @param level Alarm Escalation level (picks level string and color)
  */
-int msgBuild_makeAlertMsg( char *template_fname, char *outbuf, int bufsize, char *dept, int alarm_num, int level );
+void msgBuild_InitAlert( msgBuild_ctx_t *ctx, char *dept, int alarm_num, int level );
 
-/** @brief Creates HTML acceptance message from template and data ready to send to phone
+/** @brief Set up a render context for an acceptance message
  *
- * @param template_fname Name of alert template file
+ * [COLOR] is "green".
+ *
+ * @param ctx Context to fill in
+ * @param dept Pointer to department name (must last until rendered)
+ * @param alarm_num Alarm number for [ALARM] (-1 if not known, left empty)
+ * @param msg Message to put after department on phone screen
+ */
+void msgBuild_InitAccept( msgBuild_ctx_t *ctx, char *dept, int alarm_num, char *msg );
+
+/** @brief Render a template with a context
+ *
+ * Safe to call from several threads at once.
+ *
+ * @param template_fname Name of template file
+ * @param ctx Values for the tokens
  * @param outbuf Location to put completed message
  * @param bufsize Size of outbuf data area
- * @param msg Message to put after department on phone screen
- * @return 0 if OK, non-zero if error
+ * @return Length of message, -1 if error
+ */
+int msgBuild_Render( char *template_fname, msgBuild_ctx_t *ctx, char *outbuf, int bufsize );
+
+/** @brief Render a template with a context into a shared buffer
+ *
+ * Cached the same way as msgBuild_AlertBuf().  Safe to call from
+ * several threads at once.
+ *
+ * @param template_fname Name of template file
+ * @param ctx Values for the tokens
+ * @param bufsize Max size of message, including the '\0'
+ * @return Message (caller holds a reference), NULL if error
+ */
+msgBuf_t *msgBuild_RenderBuf( char *template_fname, msgBuild_ctx_t *ctx, int bufsize );
+
+struct tmplVer_s;
+
+/*--- Body shared by several variants of a message ---*/
+typedef struct
+{
+   msgBuf_t *body;                     // gathered message most recipients get (held)
+   struct tmplVer_s *ver;              // template it was built from (held)
+   int bufsize;                        // max size of a variant, including the '\0'
+}msgBuild_shared_t;
+
+/** @brief Render the shared body of a message
+ *
+ * The body is gathered (cached like msgBuild_RenderBuf()).  Variants
+ * of it can then be made with msgBuild_Variant().
+ *
+ * @param sh Filled in, release with msgBuild_Unshare()
+ * @param template_fname Name of template file
+ * @param ctx Values for the tokens
+ * @param bufsize Max size of message, including the '\0'
+ * @return 0 if OK, -1 if error
+ */
+int msgBuild_Share( msgBuild_shared_t *sh, char *template_fname, msgBuild_ctx_t *ctx, int bufsize );
+
+/** @brief Make a variant of a shared body for one recipient
+ *
+ * Only the tokens set in delta differ.  Nothing else is rendered or
+ * copied: the variant's other pieces are the body's.
+ *
+ * @param sh Shared body from msgBuild_Share()
+ * @param delta Values to change (NULL vals keep the body's)
+ * @return Message (caller holds a reference), NULL if error
+ */
+msgBuf_t *msgBuild_Variant( msgBuild_shared_t *sh, msgBuild_ctx_t *delta );
+
+void msgBuild_Unshare( msgBuild_shared_t *sh );                 // drop shared body (variants keep it)
+
+/** @brief Get an alert message as a shared buffer
+ *
+ * Rendered with msgBuild_InitAlert()'s values.  If it was built lately it
+ * comes from the cache, otherwise it is rendered and cached.  The buffer
+ * is sealed and must not be changed.
+ *
+ * @param template_fname Name of alert template file
+ * @param bufsize Max size of message, including the '\0'
+ * @param dept Pointer to department name
+ * @param alarm_num Alarm number
+ * @param level Alarm Escalation level
+ * @return Message (caller holds a reference), NULL if error
  */
-int msgBuild_makeAcceptMsg( char *template_fname, char *outbuf, int bufsize, char *dept, char *msg );
+msgBuf_t *msgBuild_AlertBuf( char *template_fname, int bufsize, char *dept, int alarm_num, int level );
 
 #endif
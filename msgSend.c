@@ -1,99 +1,679 @@
-/** 
+/**
  *  @file   msgSend.c
  *  @author Ron Weiland, Indyme Solutions
  *  @date   3/13/15
  *  @brief  Message sender
- * 
+ *
  * @section Description
- * Creates and sends the HTML messages to the phones in parallel using libcurl
+ * Creates and sends the HTML messages to the phones in parallel using libcurl.\n
+ * All pushes are run as non-blocking transfers through the curl multi
+ * interface.  Normally the transfers are driven from the web server's
+ * libevent loop, so pushes and phone requests share one thread.  Setting
+ * "sender_thread" in the config runs them on a thread of their own instead.
  *
  */
 
 #include <curl/curl.h>
+#include <event2/event.h>
 #include <pthread.h>
 #include <string.h>
+#include <strings.h>
+#include <stdlib.h>
 #include <malloc.h>
+#include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 
 #include "msgSend.h"
+#include "msgBuf.h"
 #include "msgBuild.h"
+#include "deptSub.h"
+#include "ackRank.h"
 #include "spRec.h"
+#include "spConn.h"
+#include "md5.h"
 #include "config.h"
 #include "logging.h"
 #include "alarms.h"
 
 #define MAX_HTML_DATA 2000       // max size of HTML message to send
 
-/*
-char *ip_addrs[] = 
-{
-   "192.168.1.248",
-   "192.168.2.2",
-   "192.168.2.3",
-   "192.168.2.4",
-   "192.168.1.221",
-};
+#define MSGSEND_POLL_MS  1000    // max time sender thread waits for activity
+
+#define MSGSEND_PUSH_URI "/push"  // where phones take pushes
 
-#define N_IP_ADDRS (sizeof( ip_addrs ) / sizeof( char *))
-*/
+#define MSGSEND_MAX_CANCELS 20    // max alarm cancels waiting for sender thread
 
-#define MAX_SPPHONES    50            // max phones to send to
+#define MSGSEND_MAX_GROUPS  32    // max subnets tracked for wave scheduling
 
-/*---  structure to pass to thread ---*/
+#define MSGSEND_MAX_ALARMS  20    // max alarms whose latest escalation level is kept
+
+/*--- Phones on one subnet (usually behind the same access point) ---*/
 typedef struct
 {
-   char *ip_addr;
-   char *msg;
-}curlThreadMsg_t;
+   uint32_t net;                    // network part of the phones' addresses
+   int active;                      // pushes running to this group
+   int wave_count;                  // pushes started in the current wave
+   long wave_start;                 // when the current wave started (ms)
+}pushGroup_t;
+
+/*--- Picks the phones a fan-out goes to ---*/
+typedef int (*pushFilter_t)( SPphone_record_t *phone, void *arg );
 
-curlThreadMsg_t msgs[ MAX_SPPHONES ];         // array of message data
+/*---  One push to one phone ---*/
+typedef struct pushXfer_s
+{
+   struct pushXfer_s *next;         // next transfer in pending or active list
+   CURL *hnd;                       // curl easy handle for this transfer
+   char ip_addr[MAX_IP_ADDR+1];     // IP address of phone to send to
+   char url[40];                    // push URL
+   msgBuf_t *msg;                   // message to send (held by the fan-out)
+   struct curl_slist *headers;      // extra headers (preemptive authorization)
+   int preemptive;                  // true if credentials sent from cached nonce
+   int auth_retry;                  // true if already resent after a stale nonce
+   int probe;                       // true if probing a phone that was unreachable
+   int short_timeout;               // true if timeouts were cut below phone_timeout from round trip times
+   char challenge[300];             // last WWW-Authenticate from phone
+   uint32_t net;                    // subnet of phone, for wave scheduling
+   pushGroup_t *group;              // group counted against while running
+   int tries;                       // times sent so far
+   int tried;                       // true once its first try is over (counted in fan-out's n_tried)
+   long retry_ms;                   // when to send again (on retry list)
+   long deadline_ms;                // no use sending after this
+   long due_ms;                     // place in the pending list, earliest first
+   char *md5;                       // digest of message (in the fan-out)
+   int sent;                        // bytes of a gathered message given to curl
+   msgSend_fanout_t *fanout;        // fan-out this push belongs to
+   msgSend_phoneResult_t *res;      // where to put result
+}pushXfer_t;
 
-char alert_msgBuf[ MAX_HTML_DATA ];           // Alert message buffer to send
-char accept_msgBuf[ MAX_HTML_DATA ];          // Accept message buffer to send
-char accept_msgBuf2[ MAX_HTML_DATA ];         // Special Accept message buffer to send
+/*--- Pushes to one phone.  Only one goes at a time so the last one sent is what the phone shows ---*/
+typedef struct phoneBox_s
+{
+   struct phoneBox_s *next;         // next box in hash bucket
+   char ip_addr[MAX_IP_ADDR+1];     // IP address of phone
+   pushXfer_t *busy;                // push running (or next to run) to phone
+   pushXfer_t *waiting;             // pushes waiting for phone, oldest first
+}phoneBox_t;
 
 static char *alert_template;                  // alert template file name / path
 static char *accept_template;                 // accept template file name / path
 static int net_timeout = 0;                   // How long to wait for response from phone
 static char authentication[40];               // username / password to send for authentication
+static char *username;                        // phone user name (for digest)
+static char *password;                        // phone password (for digest)
+static int use_https;                         // push with HTTPS instead of HTTP
+
+static CURLM *multi_hnd;                      // curl multi handle, only used by the sender
+static pthread_t msgSend_tid;                 // sender thread (if not using server's loop)
+static int use_thread;                        // true if pushes run on their own thread
+static struct event_base *ev_base;            // server's event loop (if pushes run on it)
+static struct event *wake_ev;                 // wakes event loop for new pushes and cancels
+static struct event *timer_ev;                // curl's timeout
+static struct event *tick_ev;                 // housekeeping (idle connections)
+static pthread_mutex_t msgSend_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t msgSend_once = PTHREAD_ONCE_INIT;
+
+static pushXfer_t *pending_head;              // transfers waiting for the sender, earliest due first
+static pushXfer_t *pending_tail;
+static int n_pending;                         // number of transfers waiting
+static int max_pending;                       // most transfers ever waiting
+static int n_active;                          // transfers running (sender only)
+static pushXfer_t *active_head;               // transfers running (sender only)
+
+static int cancel_alarms[ MSGSEND_MAX_CANCELS ];   // alarms to cancel pushes for
+static int n_cancels;
+
+static msgSend_stats_t stats;                 // sender statistics
+
+static int max_active_pushes;                 // max transfers running at once
+static int max_queued_pushes;                 // max transfers allowed to wait
+
+static pushGroup_t groups[ MSGSEND_MAX_GROUPS ];   // subnets pushes are going to (sender only)
+static int n_groups;
+static uint32_t group_mask;                   // netmask that makes a group
+static int group_max_active;                  // max transfers running per group
+static int group_wave_size;                   // pushes started per group per wave
+static int group_wave_ms;                     // time between waves (0 for no waves)
+static struct event *wave_ev;                 // starts the next wave
+
+static phoneBox_t **box_tab;                  // mailboxes of busy phones, hashed (sender only)
+static unsigned int box_size;                 // buckets in box_tab (power of 2)
+
+static pushXfer_t *retry_head;                // failed transfers waiting to be sent again (sender only)
+static int retry_base_ms;                     // first retry delay
+static int retry_max_ms;                      // longest retry delay
+static int max_push_tries;                    // max times to send to a phone
+static int alert_delay_ms;                    // time until next alert, retries must be done by then
+static int accept_limit_ms;                   // accepts not sent by then are dropped
+static int force_realert;                     // push alerts even to phones already showing them
+
+static struct
+{
+   int alarm;
+   int level;
+}alarm_levels[ MSGSEND_MAX_ALARMS ];          // latest escalation level pushed for recent alarms
+static int next_alarm_level;
+
+/*--- Phones an alarm's alert may be showing on ---*/
+typedef struct
+{
+   char ip_addr[MAX_IP_ADDR+1];     // phone
+   int got;                         // true if phone took the alert (or was cancelled mid-push)
+   int active;                      // alert pushes running to phone
+   int next;                        // next phone in the same hash bucket (-1 if last)
+}alertRecip_t;
+
+typedef struct
+{
+   int alarm;                       // alarm number (-1 if slot is free)
+   int n_phones;                    // phones in list
+   int max_phones;                  // room in list
+   alertRecip_t *phones;
+   int *buckets;                    // phone hash, index of first phone in bucket (-1 if none)
+   int n_buckets;                   // buckets in hash (power of 2, same as max_phones)
+   int n_active;                    // alert pushes running to phones on the list
+   long used_ms;                    // last time list was changed
+}alarmRecips_t;
+
+static alarmRecips_t alarm_recips[ MSGSEND_MAX_ALARMS ];   // recipients of recent alarms
+
+typedef struct
+{
+   char *ips;                       // sorted alert recipients, MAX_IP_ADDR+1 bytes each
+   int count;
+   char *accept_ip;                 // accepting phone (always gets it)
+}recipFilter_t;
+
+/*--- Phones in one stage of a progressive alert ---*/
+typedef struct
+{
+   deptSub_t *sub;                  // department's phones (NULL if all phones)
+   char *ips;                       // sorted phones of first stage, MAX_IP_ADDR+1 bytes each
+   int count;
+   int first;                       // true for first stage, false for the rest
+}stageFilter_t;
+
+/*--- Progressive alert waiting to go to the rest of the phones ---*/
+typedef struct widen_s
+{
+   struct widen_s *next;
+   char *dept;                      // department
+   int alarm;
+   int level;
+   msgBuf_t *msg;                   // alert (holds a reference)
+   int routed;                      // true if only to sub's phones
+   deptSub_t sub;
+   char *ips;                       // phones of first stage, sorted
+   int count;
+   long due_ms;                     // when to widen if not acked
+   msgSend_PhoneCB_t phone_cb;      // callbacks for the second push
+   msgSend_FanoutCB_t done_cb;
+   void *cb_data;
+}widen_t;
+
+static widen_t *widen_head;                   // progressive alerts not widened yet
+static int progressive_first;                 // phones a first alert goes to first (0 for all at once)
+static int progressive_wait_ms;               // time to wait for an ack before the rest get it
 
-int _msgSend_PushMsgs( char *msg, char *special_ip, char *specal_msg );
-void *_msgSend_PushMsgThread( void *ip_addr );
+void _msgSend_Init( void );
+void _msgSend_ReadConfig( void );
+int _msgSend_PushMsgs( msgBuf_t *msg, char *special_ip, msgBuf_t *special_msg, msgSend_fanout_t *fanout, pushFilter_t want, void *want_arg );
+int _msgSend_Subscribed( SPphone_record_t *phone, void *arg );
+int _msgSend_Recipient( SPphone_record_t *phone, void *arg );
+int _msgSend_InStage( SPphone_record_t *phone, void *arg );
+char *_msgSend_PickFirst( char *dept, deptSub_t *sub, int *count );
+int _msgSend_CompareScore( const void *a, const void *b );
+void _msgSend_StageDone( msgSend_fanout_t *fanout, void *data );
+long _msgSend_DoWidens( void );
+void _msgSend_FreeWiden( widen_t *w );
+msgSend_fanout_t *_msgSend_AlertFanout( char *dept, int alarm, int level, msgSend_PhoneCB_t phone_cb, msgSend_FanoutCB_t done_cb, void *cb_data );
+void _msgSend_RecipUpdate( pushXfer_t *xfer, int active, int got );
+alarmRecips_t *_msgSend_FindRecips( int alarm, int create );
+int _msgSend_RecipsBusy( alarmRecips_t *ar );
+int _msgSend_RecipIndex( alarmRecips_t *ar, char *ip_addr, int create );
+char *_msgSend_GetRecips( int alarm, int *count );
+void _msgSend_AcceptDone( msgSend_fanout_t *fanout, void *data );
+int _msgSend_CompareIp( const void *a, const void *b );
+msgSend_fanout_t *_msgSend_NewFanout( int alarm, msgSend_PhoneCB_t phone_cb, msgSend_FanoutCB_t done_cb, void *cb_data );
+void _msgSend_NoteLevel( int alarm, int level );
+int _msgSend_Superseded( msgSend_fanout_t *fanout );
+int _msgSend_RetryLater( pushXfer_t *xfer );
+long _msgSend_DoRetries( void );
+void _msgSend_XferRelease( pushXfer_t *xfer, int got );
+void _msgSend_FanoutDone( msgSend_fanout_t *fanout );
+void _msgSend_AlertDone( msgSend_fanout_t *fanout, void *data );
+void _msgSend_FirstTryOver( pushXfer_t *xfer, int finishing );
+long _msgSend_NowMs( void );
+void *_msgSend_RunThread( void *arg );
+long _msgSend_Service( void );
+void _msgSend_Wakeup( void );
+int _msgSend_SocketCB( CURL *hnd, curl_socket_t sock, int what, void *userp, void *sockp );
+int _msgSend_TimerCB( CURLM *multi, long timeout_ms, void *userp );
+void _msgSend_EventCB( evutil_socket_t fd, short what, void *arg );
+void _msgSend_TimeoutCB( evutil_socket_t fd, short what, void *arg );
+void _msgSend_WakeCB( evutil_socket_t fd, short what, void *arg );
+void _msgSend_TickCB( evutil_socket_t fd, short what, void *arg );
+long _msgSend_StartPending( void );
+long _msgSend_GroupWait( pushXfer_t *xfer, long now );
+pushGroup_t *_msgSend_FindGroup( uint32_t net );
+uint32_t _msgSend_Network( char *ip_addr );
+void _msgSend_XferSetup( pushXfer_t *xfer );
+void _msgSend_XferDone( pushXfer_t *xfer, CURLcode ret );
+void _msgSend_XferFinish( pushXfer_t *xfer, int result, long httpCode );
+void _msgSend_DoCancels( void );
+void _msgSend_QueueXfers( pushXfer_t *head, pushXfer_t *tail, int count );
+phoneBox_t *_msgSend_FindBox( char *ip_addr, int create );
+unsigned int _msgSend_BoxHash( char *ip_addr );
+unsigned int _msgSend_IpHash( char *ip_addr );
+void _msgSend_BoxPost( phoneBox_t *box, pushXfer_t *xfer );
+void _msgSend_BoxDone( pushXfer_t *xfer );
+void _msgSend_Coalesce( pushXfer_t *xfer );
+void _msgSend_LogResult( msgSend_phoneResult_t *res );
 size_t _msgSend_WriteCallback( void *buffer, size_t size, size_t nmemb, void *data );
+size_t _msgSend_HeaderCallback( char *buffer, size_t size, size_t nitems, void *data );
+size_t _msgSend_ReadCallback( char *buffer, size_t size, size_t nitems, void *data );
+int _msgSend_SeekCallback( void *data, curl_off_t offset, int origin );
+void _msgSend_Digest( msgBuf_t *msg, char hex[33] );
 
 #if 0
-int main( void )
+/*
+ * Fan-out benchmark.  Pushes an alert to n simulated phones (default is
+ * max_phones from the config, set it to 1000 or more) from the same event
+ * loop a local web server is answering them on.  Every 127.x.y.z address
+ * is loopback, so each phone gets its own address.
+ * Link with everything but main.o / plugins.o, run from the directory
+ * holding the config and data/sp8440/alert.
+ */
+#include <event2/http.h>
+#include <event2/thread.h>
+
+static long bench_start;
+
+void register_sp8440_alarm( int (*fun)(char *msg, int alarm, int level) ) {}    // CLX supplies this
+
+static void _bench_Reply( struct evhttp_request *req, void *arg )
+{
+   evhttp_send_reply( req, 200, "OK", NULL );
+}
+
+static void _bench_Done( msgSend_fanout_t *fanout, void *data )
+{
+   msgSend_stats_t st;
+   int i;
+   int worst = 0;
+
+   for ( i = 0; i < fanout->n_phones; i++ )
+   {
+      if ( fanout->results[i].latency_ms > worst )
+      {
+         worst = fanout->results[i].latency_ms;
+      }
+   }
+   msgSend_GetStats( &st );
+   printf( "%d of %d phones OK in %ld ms, slowest %d ms, sent %lu failed %lu\n",
+           fanout->n_ok, fanout->n_phones, _msgSend_NowMs() - bench_start, worst, st.sent, st.failed );
+   event_base_loopbreak( (struct event_base *)data );
+}
+
+int main( int argc, char *argv[] )
 {
-   spRec_Init();                              // initialize phone records handler
-   msgSend_PushMsgs( "tools" );
+   int n;
+   struct event_base *base;
+   struct evhttp *http;
+   char ip[MAX_IP_ADDR+1];
+   char mac[20];
+   long t;
+   int i;
+
+   evthread_use_pthreads();
+   base = event_base_new();
+   http = evhttp_new( base );
+   if ( evhttp_bind_socket( http, "0.0.0.0", 8090 ) != 0 )
+   {
+      printf( "Can't bind port 8090\n" );
+      return 1;
+   }
+   evhttp_set_gencb( http, _bench_Reply, NULL );
+
+   config_init( CFGNAME );
+   spRec_Init();
+   n = (argc > 1) ? atoi( argv[1] ) : spRec_GetMaxPhones();
+   if ( n > spRec_GetMaxPhones() )
+   {
+      printf( "Only room for %d phones, raise max_phones\n", spRec_GetMaxPhones() );
+      return 1;
+   }
+
+   t = _msgSend_NowMs();
+   for ( i = 0; i < n; i++ )
+   {
+      snprintf( ip, sizeof( ip ), "127.0.%d.%d:8090", i / 250, i % 250 + 1 );
+      snprintf( mac, sizeof( mac ), "00-00-00-00-%02x-%02x", i >> 8, i & 0xff );
+      spRec_AddRecord( ip, mac, i );
+   }
+   printf( "Added %d phones in %ld ms\n", n, _msgSend_NowMs() - t );
+
+   msgSend_SetEventBase( base );
+   bench_start = _msgSend_NowMs();
+   msgSend_PushAlertAsync( "tools", 1, 0, NULL, _bench_Done, base );
+   event_base_dispatch( base );
    return 0;
 }
 #endif
 
+/*-------------------------( msgSend_Init )-------------------------
+
+  Set up the sender.  Safe to call more than once.
+  If pushes run on the web server's loop, nothing is sent until
+  msgSend_SetEventBase is called.
+
+-----------------------------------------------------------------*/
+
+void msgSend_Init( void )
+{
+   pthread_once( &msgSend_once, _msgSend_Init );
+}
+
+void _msgSend_Init( void )
+{
+   pthread_attr_t attr;
+   int stack_kb;
+   int bits;
+
+   curl_global_init( CURL_GLOBAL_ALL );
+   spConn_Init();
+   spRec_SetRemoveHook( spConn_Drop );         // close connections of removed phones
+
+   max_active_pushes = config_readInt( "phones", "max_active_pushes", 32 );
+   // Room for an alert and an accept to every phone by default
+   max_queued_pushes = config_readInt( "phones", "max_queued_pushes", (spRec_GetMaxPhones() > 250) ? spRec_GetMaxPhones() * 2 : 500 );
+
+   // Phones on the same subnet share an access point.  If it can't take them
+   // all at once, set group_max_active lower and group_wave_ms (e.g. 50) to
+   // start group_wave_size pushes per subnet per wave.  Off by default: a
+   // site's phones are usually all on one subnet, and waves would hold the
+   // last of them back by seconds
+   bits = config_readInt( "phones", "group_prefix_bits", 24 );
+   group_mask = (bits <= 0) ? 0 : (bits >= 32) ? 0xffffffff : ~(0xffffffffu >> bits);
+   group_max_active = config_readInt( "phones", "group_max_active", max_active_pushes );
+   group_wave_size = config_readInt( "phones", "group_wave_size", 4 );
+   group_wave_ms = config_readInt( "phones", "group_wave_ms", 0 );
+
+   // Failed alert pushes are sent again until the next alert is due
+   retry_base_ms = config_readInt( "phones", "retry_base_ms", 500 );
+   retry_max_ms = config_readInt( "phones", "retry_max_ms", 4000 );
+   max_push_tries = config_readInt( "phones", "push_tries", 5 );
+   srandom( (unsigned int)time( NULL ) ^ (unsigned int)getpid() );     // retry jitter differs each run
+   alert_delay_ms = config_readInt( "phones", "alert_delay", 10 ) * 1000;
+   accept_limit_ms = config_readInt( "phones", "accept_timeout", 60 ) * 1000;   // stale alert on a phone is worse than a late accept
+   use_thread = config_readInt( "phones", "sender_thread", 0 );
+   use_https = config_readInt( "phones", "push_https", 0 );
+
+   // First alerts can go to the phones likeliest to ack before the rest
+   progressive_first = config_readInt( "phones", "progressive_first", 0 );
+   progressive_wait_ms = config_readInt( "phones", "progressive_wait_ms", 3000 );
+
+   // Mailboxes for phones with a push going
+   for ( box_size = 16; box_size < (unsigned int)spRec_GetMaxPhones() * 2; box_size <<= 1 );
+   if ( (box_tab = calloc( box_size, sizeof( phoneBox_t * ))) == NULL )
+   {
+      Log( ERROR, "%s: Can't malloc %u phone mailboxes!\n", __func__, box_size );
+      box_size = 0;
+   }
+
+   multi_hnd = curl_multi_init();
+   curl_multi_setopt( multi_hnd, CURLMOPT_MAXCONNECTS, (long)spConn_MaxConnects() );  // keep idle connections open
+
+   if ( !use_thread )
+   {
+      // Web server's event loop watches the sockets for curl
+      curl_multi_setopt( multi_hnd, CURLMOPT_SOCKETFUNCTION, _msgSend_SocketCB );
+      curl_multi_setopt( multi_hnd, CURLMOPT_TIMERFUNCTION, _msgSend_TimerCB );
+      Log( DEBUG, "%s: Sender using server event loop. Max active %d, max queued %d\n", __func__, max_active_pushes, max_queued_pushes );
+      return;
+   }
+
+   // Sender thread doesn't need the default 8MB stack
+   stack_kb = config_readInt( "phones", "sender_stack_size", 256 );
+   pthread_attr_init( &attr );
+   if ( stack_kb > 0 && pthread_attr_setstacksize( &attr, (size_t)stack_kb * 1024 ) != 0 )
+   {
+      Log( WARN, "%s: Can't set sender stack size to %dK\n", __func__, stack_kb );
+   }
+   pthread_create( &msgSend_tid, &attr, _msgSend_RunThread, NULL );
+   pthread_attr_destroy( &attr );
+
+   Log( DEBUG, "%s: Sender started. Max active %d, max queued %d\n", __func__, max_active_pushes, max_queued_pushes );
+}
+
+
+/*-------------------------( msgSend_SetEventBase )-------------------------
+
+  Called from the web server thread once its event loop is made.
+  Pushes are run from that loop from now on.  Does nothing if
+  pushes have their own thread.
+
+--------------------------------------------------------------------------*/
+
+void msgSend_SetEventBase( struct event_base *base )
+{
+   struct timeval tv = { MSGSEND_POLL_MS / 1000, (MSGSEND_POLL_MS % 1000) * 1000 };
+
+   msgSend_Init();
+   if ( use_thread || ev_base != NULL )
+   {
+      return;
+   }
+
+   ev_base = base;
+   timer_ev = evtimer_new( base, _msgSend_TimeoutCB, NULL );
+   tick_ev = event_new( base, -1, EV_PERSIST, _msgSend_TickCB, NULL );
+   wave_ev = evtimer_new( base, _msgSend_WakeCB, NULL );
+   event_add( tick_ev, &tv );
+
+   pthread_mutex_lock( &msgSend_mutex );
+   wake_ev = event_new( base, -1, 0, _msgSend_WakeCB, NULL );
+   pthread_mutex_unlock( &msgSend_mutex );
+
+   _msgSend_Wakeup();                          // send anything queued before now
+}
+
+
+/*-------------------------( msgSend_GetQueueDepth )-------------------------
+
+  Return number of pushes waiting for the sender.
+  If max_depth isn't NULL, it gets the most that have ever been waiting.
+
+--------------------------------------------------------------------------*/
+
+int msgSend_GetQueueDepth( int *max_depth )
+{
+   int depth;
+
+   pthread_mutex_lock( &msgSend_mutex );
+   depth = n_pending;
+   if ( max_depth != NULL )
+   {
+      *max_depth = max_pending;
+   }
+   pthread_mutex_unlock( &msgSend_mutex );
+
+   return depth;
+}
+
+
+/*-------------------------( msgSend_GetStats )-------------------------
+
+  Get a copy of the sender statistics
+
+---------------------------------------------------------------------*/
+
+void msgSend_GetStats( msgSend_stats_t *st )
+{
+   pthread_mutex_lock( &msgSend_mutex );
+   *st = stats;
+   pthread_mutex_unlock( &msgSend_mutex );
+}
+
+
+/*-------------------------( msgSend_LogStats )-------------------------
+
+  Log the sender statistics and queue depth.  Called every second from
+  the main housekeeping loop; logs at most every stats_log_interval
+  seconds (0 for never), and only if there were pushes since last time.
+
+---------------------------------------------------------------------*/
+
+void msgSend_LogStats( void )
+{
+   static int interval = -1;
+   static time_t next_log;
+   static unsigned long last_count;
+   msgSend_stats_t st;
+   unsigned long count;
+   time_t now = time( NULL );
+   int max_depth;
+   int depth;
+
+   if ( interval < 0 )
+   {
+      interval = config_readInt( "phones", "stats_log_interval", 60 );
+      next_log = now + interval;
+   }
+   if ( interval == 0 || now < next_log )
+   {
+      return;
+   }
+   next_log = now + interval;
+
+   msgSend_GetStats( &st );
+   count = st.sent + st.skipped + st.cancelled + st.unchanged + st.expired;
+   if ( count == last_count )
+   {
+      return;                                   // nothing new
+   }
+   last_count = count;
+
+   depth = msgSend_GetQueueDepth( &max_depth );
+   Log( INFO, "%s: Pushes sent %lu (ok %lu, rejected %lu, failed %lu), retried %lu, skipped %lu, "
+        "cancelled %lu, coalesced %lu, unchanged %lu, expired %lu.  Queue %d (most %d)\n", __func__,
+        st.sent, st.ok, st.rejected, st.failed, st.retried, st.skipped,
+        st.cancelled, st.coalesced, st.unchanged, st.expired, depth, max_depth );
+}
+
+
 void msgSend_PushAlert( char *dept, int alarm, int level )
 {
+   msgSend_PushAlertAsync( dept, alarm, level, NULL, _msgSend_AlertDone, NULL );
+}
+
+void msgSend_PushAlertAsync( char *dept, int alarm, int level, msgSend_PhoneCB_t phone_cb, msgSend_FanoutCB_t done_cb, void *data )
+{
+   msgSend_fanout_t *fanout;
+   msgBuf_t *msg;
+   deptSub_t sub;
+   int routed;
    char fname[100];
+   stageFilter_t stage;
+   widen_t *w = NULL;
 
-   if ( alert_template == NULL );
+   if ( alert_template == NULL )
    {
       sprintf( fname, "%s%s", BASEDIR, config_readStr( "phones", "alert_template", "alert" ));
       alert_template = malloc( strlen( fname )+1 );
       strcpy( alert_template, fname );               // copy over file name with path
    }
 
-   // create the message to send
-   msgBuild_makeAlertMsg( alert_template, alert_msgBuf, MAX_HTML_DATA, dept, alarm, level );
+   // get the message to send (same one as last time if nothing changed)
+   msg = msgBuild_AlertBuf( alert_template, MAX_HTML_DATA, dept, alarm, level );
+   if ( msg == NULL )
+   {
+      Log( ERROR, "%s: Can't build alert message for alarm %d\n", __func__, alarm );
+      return;
+   }
+
+   // Only phones covering the department, until the alarm escalates far enough
+   routed = 0;
+   if ( level < deptSub_WidenLevel() && deptSub_Get( dept, &sub ) == 0 )
+   {
+      if ( deptSub_Present( &sub ) != 0 )
+      {
+         routed = 1;
+      }
+      else
+      {
+         Log( INFO, "%s: No phones for department \"%s\" registered.  Sending alarm %d to all\n", __func__, dept, alarm );
+      }
+   }
+
+   // First alert may go to the best few phones first
+   stage.sub = routed ? &sub : NULL;
+   stage.first = 1;
+   stage.ips = NULL;
+   if ( level == 0 && progressive_first > 0 &&
+        (stage.ips = _msgSend_PickFirst( dept, stage.sub, &stage.count )) != NULL )
+   {
+      if ( (w = calloc( 1, sizeof( widen_t ))) == NULL || (w->dept = strdup( dept )) == NULL )
+      {
+         Log( ERROR, "%s: Can't malloc progressive alert!  Sending to all\n", __func__ );
+         free( w );
+         free( stage.ips );
+         stage.ips = NULL;
+         w = NULL;
+      }
+   }
+
+   if ( w != NULL )
+   {
+      w->alarm = alarm;
+      w->level = level;
+      w->msg = msgBuf_Ref( msg );
+      w->routed = routed;
+      w->sub = sub;
+      w->ips = stage.ips;
+      w->count = stage.count;
+      w->phone_cb = phone_cb;
+      w->done_cb = done_cb;
+      w->cb_data = data;
+      w->due_ms = _msgSend_NowMs() + progressive_wait_ms;
+
+      if ( (fanout = _msgSend_AlertFanout( dept, alarm, level, phone_cb, _msgSend_StageDone, data )) == NULL )
+      {
+         w->due_ms = 0;                        // rest of the phones get it now
+      }
+      pthread_mutex_lock( &msgSend_mutex );
+      w->next = widen_head;
+      widen_head = w;
+      pthread_mutex_unlock( &msgSend_mutex );
 
-   if ( _msgSend_PushMsgs( alert_msgBuf, NULL, NULL ) == 0 )         // no phones available?
+      Log( INFO, "%s: Alarm %d to %d best phones first\n", __func__, alarm, stage.count );
+      if ( fanout != NULL )
+      {
+         _msgSend_PushMsgs( msg, NULL, NULL, fanout, _msgSend_InStage, &stage );
+      }
+      _msgSend_Wakeup();
+   }
+   else if ( (fanout = _msgSend_AlertFanout( dept, alarm, level, phone_cb, done_cb, data )) != NULL )
    {
-      Log( INFO, "%s: No phones available.  Escalating alarm %d now\n", __func__, alarm );
-      escalate_alarm( alarm );          // escalate alarm now
+      _msgSend_PushMsgs( msg, NULL, NULL, fanout, routed ? _msgSend_Subscribed : NULL, &sub );
    }
+   msgBuf_Unref( msg );                        // fan-out has its own reference
 }
 
-void msgSend_PushAccept( char *dept, int type, char *accept_ip )
+void msgSend_PushAccept( char *dept, int alarm, int type, char *accept_ip )
 {
-   char *msg;
+   msgSend_fanout_t *fanout;
+   msgBuf_t *msg;
+   msgBuf_t *msg2;
+   msgBuild_ctx_t ctx;
+   msgBuild_ctx_t delta;
+   msgBuild_shared_t sh;
+   char *text;
    char fname[100];
+   int ret;
+   recipFilter_t recips;
 
    if ( accept_template == NULL )
    {
@@ -102,170 +682,2270 @@ void msgSend_PushAccept( char *dept, int type, char *accept_ip )
       strcpy( accept_template, fname );               // copy over file name with path
    }
 
-   msg = (type == 0) ? "Request Accepted" : "Request Complete";
+   text = (type == 0) ? "Request Accepted" : "Request Complete";
 
    // Make accept message for all phones except the one that accepted
-   msgBuild_makeAcceptMsg( accept_template, accept_msgBuf, MAX_HTML_DATA, dept, msg );
+   msgBuild_InitAccept( &ctx, dept, alarm, text );
+   msg = msg2 = NULL;
+   if ( msgBuild_Share( &sh, accept_template, &ctx, MAX_HTML_DATA ) == 0 )
+   {
+      msg = msgBuf_Ref( sh.body );
+
+      // Phone that accepted gets the same body with a different line
+      memset( &delta, 0, sizeof( delta ));
+      delta.vals[ MSGBUILD_LEVEL ] = "You've accepted";
+      msg2 = msgBuild_Variant( &sh, &delta );
+      msgBuild_Unshare( &sh );
+   }
+   ret = (msg == NULL || msg2 == NULL);
+
+   // Stop any alert pushes for this alarm still going out
+   if ( alarm >= 0 )
+   {
+      msgSend_CancelAlarm( alarm );
+   }
 
-   // Make accept message for phone that accepted
-   msgBuild_makeAcceptMsg( accept_template, accept_msgBuf2, MAX_HTML_DATA, dept, "You've accepted" );
+   // Only phones that may be showing the alert.  All phones if we don't know
+   recips.ips = (alarm >= 0) ? _msgSend_GetRecips( alarm, &recips.count ) : NULL;
+   recips.accept_ip = accept_ip;
 
-   // Send to all phones
-   _msgSend_PushMsgs( accept_msgBuf, accept_ip, accept_msgBuf2 );
+   if ( ret != 0 )
+   {
+      Log( ERROR, "%s: Can't build accept message for alarm %d\n", __func__, alarm );
+   }
+   else if ( (fanout = _msgSend_NewFanout( -1, NULL, _msgSend_AcceptDone, NULL )) != NULL )
+   {
+      fanout->about = alarm;                   // replaces the alert if still waiting for a phone
+      fanout->type = type;
+      _msgSend_PushMsgs( msg, accept_ip, msg2, fanout, (recips.ips != NULL) ? _msgSend_Recipient : NULL, &recips );
+   }
+   msgBuf_Unref( msg );
+   msgBuf_Unref( msg2 );
+   free( recips.ips );
 }
 
 
-int _msgSend_PushMsgs( char *msg, char *special_ip, char *special_msg )
+/*-------------------------( _msgSend_AcceptDone )-------------------------
+
+  All pushes for an accept are finished.  The alarm's alert pushes were
+  cancelled before it went out, so its recipient list is no longer needed.
+
+-------------------------------------------------------------------------*/
+
+void _msgSend_AcceptDone( msgSend_fanout_t *fanout, void *data )
 {
-   int i;
-   pthread_t tid[ MAX_SPPHONES ];            // array of thread ids
-   int msgIndex;
-   SPphone_record_t *phone;                  // phone informatiion
-   char *username;
-   char *password;
-   int len;
+   alarmRecips_t *ar;
 
-   // If we haven't read values from config yet, try now
-   if ( net_timeout == 0 || *authentication == '\0' )     // Haven't read values yet?
+   if ( fanout->about < 0 )
    {
-      net_timeout = config_readInt( "phones", "phone_timeout", 5 );
-      Log( DEBUG, "%s: Setting phone timeout to %d\n", __func__, net_timeout ); 
-      username = config_readStr( "phones", "phone_username", "admin" );
-      password = config_readStr( "phones", "phone_password", "456" );
-      len = snprintf( authentication, sizeof( authentication ), "%s:%s", username, password );      // authentication string
-      if ( len >= sizeof( authentication ) )
-      {
-         Log(WARN, "%s: Authenticaton string too long! \"%s\". Max size is %d bytes\n", __func__, authentication, (int)sizeof(authentication));
-      }
+      return;
    }
 
-   // create the send threads
-   phone = NULL;                             // start with first record
-   msgIndex = 0;
-   while( (phone = spRec_GetNextRecord( phone )) != NULL )
+   pthread_mutex_lock( &msgSend_mutex );
+   if ( (ar = _msgSend_FindRecips( fanout->about, 0 )) != NULL && !_msgSend_RecipsBusy( ar ))
    {
-      msgs[ msgIndex ].ip_addr = phone->ip_addr;   // IP address of phone to send to
-
-      // check if special message for this IP
-      if ( (special_ip != NULL) && (strncmp( special_ip, phone->ip_addr, strlen( phone->ip_addr)) == 0 ))
-      {
-         msgs[ msgIndex ].msg = special_msg;       // use special message
-      }
-      else
-      {
-         msgs[ msgIndex ].msg = msg;               // message pointer
-      }
-      pthread_create( &tid[ msgIndex ], NULL, _msgSend_PushMsgThread, (void *)&msgs[ msgIndex ] );
-      msgIndex++;
+      ar->n_phones = 0;                        // slot free, list memory kept for next one
    }
+   pthread_mutex_unlock( &msgSend_mutex );
+}
 
-#if 0
-   /* now wait for all threads to terminate */
-   for(i=0; i< msgIndex; i++)
+
+/*-------------------------( _msgSend_AlertDone )-------------------------
+
+  All pushes for an alert are finished.
+  If no phone actually got it, escalate the alarm now rather than
+  waiting out the alert delay (unless that was done after the first
+  tries).
+
+-----------------------------------------------------------------------*/
+
+void _msgSend_AlertDone( msgSend_fanout_t *fanout, void *data )
+{
+   if ( fanout->cancelled || fanout->escalated )
    {
-      pthread_join(tid[i], NULL);
-//      fprintf(stderr, "Thread %d terminated\n", i);
+      return;                                   // alarm was accepted, or already escalated
    }
-#else
-   for(i=0; i< msgIndex; i++)
+   else if ( fanout->n_phones == 0 )
    {
-      pthread_detach(tid[i]);
+      Log( INFO, "%s: No phones available.  Escalating alarm %d now\n", __func__, fanout->alarm );
+      escalate_alarm( fanout->alarm );          // escalate alarm now
+   }
+   else if ( fanout->n_ok == 0 )
+   {
+      Log( INFO, "%s: Alarm %d not delivered to any of %d phones.  Escalating now\n", __func__, fanout->alarm, fanout->n_phones );
+      escalate_alarm( fanout->alarm );
    }
-#endif
-
-   return msgIndex;            // return number of phones messages are being sent to
 }
 
 
-void *_msgSend_PushMsgThread( void *msg )
+/*-------------------------( _msgSend_FirstTryOver )-------------------------
+
+  A push's first try is over: it finished, or failed and is waiting to
+  retry.  Once every phone of an alert has had its first try and none
+  took it, the alarm is escalated now.  The retries go on meanwhile,
+  instead of holding the escalation back until the last one gives up.
+  finishing is true if the push is finishing (not going to retry).
+
+-------------------------------------------------------------------------*/
+
+void _msgSend_FirstTryOver( pushXfer_t *xfer, int finishing )
 {
-   int ret;
-   curlThreadMsg_t *msgData;
-   char ip_buf[ 40 ];
-   long httpCode = 0L;
+   msgSend_fanout_t *fanout = xfer->fanout;
 
-//   char errorBuf[ CURL_ERROR_SIZE ];       // CURL error buffer
+   if ( xfer->tried )
+   {
+      return;
+   }
+   xfer->tried = 1;
 
-   msgData = (curlThreadMsg_t *)msg;
-   CURL *hnd = curl_easy_init();
+   if ( ++fanout->n_tried == fanout->n_phones && fanout->n_done + finishing < fanout->n_phones &&
+        fanout->n_ok == 0 && !fanout->cancelled && fanout->done_cb == _msgSend_AlertDone &&
+        !_msgSend_Superseded( fanout ))
+   {
+      Log( INFO, "%s: Alarm %d not delivered to any of %d phones on first try.  Escalating now\n", __func__, fanout->alarm, fanout->n_phones );
+      fanout->escalated = 1;
+      escalate_alarm( fanout->alarm );
+   }
+}
 
-   // Create OPT with given IP address
-   sprintf( ip_buf, "http://%s/push", msgData->ip_addr );
-   curl_easy_setopt(hnd, CURLOPT_URL, ip_buf );
 
-//   curl_easy_setopt(hnd, CURLOPT_USERPWD, "admin:456");
-   curl_easy_setopt(hnd, CURLOPT_USERPWD, authentication );
-   curl_easy_setopt(hnd, CURLOPT_POSTFIELDS, msgData->msg);
-   curl_easy_setopt(hnd, CURLOPT_USERAGENT, "curl/7.22.0 (x86_64-pc-linux-gnu) libcurl/7.22.0 OpenSSL/1.0.1 zlib/1.2.3.4 libidn/1.23 librtmp/2.3");
-   curl_easy_setopt(hnd, CURLOPT_HTTPAUTH, 2L);
+/*-------------------------( _msgSend_ReadConfig )-------------------------
 
-   curl_easy_setopt(hnd, CURLOPT_TIMEOUT, 5L );                        // Set timeout to 5 seconds
-   curl_easy_setopt(hnd, CURLOPT_WRITEFUNCTION, _msgSend_WriteCallback );   // Set the received data callback function
-   curl_easy_setopt(hnd, CURLOPT_WRITEDATA, msg );                     // Structure to send to callback function
-   curl_easy_setopt(hnd, CURLOPT_NOSIGNAL, 1);                         // shut off signals (to avoid "Alarm clock" in pthreads)
+  Read the phone timeout and authentication values from config.
 
-   /*--- Unneeded operations ---*/
-   // curl_easy_setopt(hnd, CURLOPT_ERRORBUFFER, errorBuf );  // Set error buffer
-   // curl_easy_setopt(hnd, CURLOPT_NOPROGRESS, 1L);
-   // curl_easy_setopt(hnd, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)-1);
-   // curl_easy_setopt(hnd, CURLOPT_MAXREDIRS, 50L);
+-----------------------------------------------------------------------*/
 
-   Log( DEBUG, "%s: Sending to %s\n", __func__, msgData->ip_addr );
+void _msgSend_ReadConfig( void )
+{
+   int len;
 
-   if ( (ret = curl_easy_perform(hnd)) != 0 )
-   {
-      Log( DEBUG, "%s: Failed on connection \"%s\": error: %d, %s\n", __func__, msgData->ip_addr, ret, curl_easy_strerror(ret) );
-   }
-   else
+   // If we haven't read values from config yet, try now
+   if ( net_timeout == 0 || *authentication == '\0' )     // Haven't read values yet?
    {
-      curl_easy_getinfo(hnd, CURLINFO_RESPONSE_CODE, &httpCode );       // Get the HTTP response code
-      if ( httpCode == 200 )
-      {
-         PLog( INFO, "%s Msg push successful to \"%s\"\n", __func__, msgData->ip_addr );
-      }
-      else
+      net_timeout = config_readInt( "phones", "phone_timeout", 5 );
+      Log( DEBUG, "%s: Setting phone timeout to %d\n", __func__, net_timeout );
+      force_realert = config_readInt( "phones", "force_realert", 0 );
+      username = config_readStr( "phones", "phone_username", "admin" );
+      password = config_readStr( "phones", "phone_password", "456" );
+      len = snprintf( authentication, sizeof( authentication ), "%s:%s", username, password );      // authentication string
+      if ( len >= sizeof( authentication ) )
       {
-         PLog( WARN, "%s Send Failed on \"%s\". Response code: %ld\n\n", __func__, msgData->ip_addr, httpCode );
+         Log(WARN, "%s: Authenticaton string too long! \"%s\". Max size is %d bytes\n", __func__, authentication, (int)sizeof(authentication));
       }
    }
+}
 
-   curl_easy_cleanup(hnd);
 
-   /* Here is a list of options the curl code used that cannot get generated
-      as source easily. You may select to either not use them or implement
-      them yourself.
+/*-------------------------( _msgSend_NewFanout )-------------------------
 
-      CURLOPT_WRITEDATA set to a objectpointer
-      CURLOPT_WRITEFUNCTION set to a functionpointer
-      CURLOPT_READDATA set to a objectpointer
-      CURLOPT_READFUNCTION set to a functionpointer
-      CURLOPT_SEEKDATA set to a objectpointer
-      CURLOPT_SEEKFUNCTION set to a functionpointer
-      CURLOPT_ERRORBUFFER set to a objectpointer
-      CURLOPT_HTTPHEADER set to a objectpointer
-      CURLOPT_STDERR set to a objectpointer
-      CURLOPT_SOCKOPTFUNCTION set to a functionpointer
-      CURLOPT_SOCKOPTDATA set to a objectpointer
+  Create a fan-out to collect the results of a push to a set of phones.
 
-   */
-   return NULL;
+  Returns fan-out, or NULL if out of memory
+-----------------------------------------------------------------------*/
+
+msgSend_fanout_t *_msgSend_NewFanout( int alarm, msgSend_PhoneCB_t phone_cb, msgSend_FanoutCB_t done_cb, void *cb_data )
+{
+   msgSend_fanout_t *fanout;
+
+   if ( (fanout = calloc( 1, sizeof( msgSend_fanout_t ))) == NULL )
+   {
+      Log( ERROR, "%s: Can't malloc fan-out!\n", __func__ );
+      return NULL;
+   }
+   fanout->alarm = alarm;
+   fanout->level = -1;
+   fanout->about = alarm;
+   fanout->type = -1;
+   fanout->phone_cb = phone_cb;
+   fanout->done_cb = done_cb;
+   fanout->cb_data = cb_data;
+   fanout->start_ms = _msgSend_NowMs();
+   return fanout;
 }
 
-/*-------------------------( _msgSender_WriteCallback )-------------------------
-  This function receives data from the phones in response to the data push.
-  We don't want to do anything with it, we just don't want it to go to stdout.
-  Data pointed to by buffer is NOT null-terminated!
 
-  This function MUST return the total number of bytes passed to it!
------------------------------------------------------------------------------*/
+/*-------------------------( _msgSend_AlertFanout )-------------------------
 
-size_t _msgSend_WriteCallback( void *buffer, size_t size, size_t nmemb, void *data )
-{
-//   printf( "%s called for address %s\n", __func__, ((curlThreadMsg_t *)data)->ip_addr );
+  Create the fan-out for an alert
 
-//   printf( "Size: %d:%d, Data: \n", (int)size, (int)nmemb );
-//   fwrite( buffer, size, nmemb, stdout );
+  Returns fan-out, or NULL if out of memory
+-------------------------------------------------------------------------*/
 
-   return size * nmemb;         // Tell curl we've handled the data
+msgSend_fanout_t *_msgSend_AlertFanout( char *dept, int alarm, int level, msgSend_PhoneCB_t phone_cb, msgSend_FanoutCB_t done_cb, void *cb_data )
+{
+   msgSend_fanout_t *fanout;
+
+   if ( (fanout = _msgSend_NewFanout( alarm, phone_cb, done_cb, cb_data )) == NULL )
+   {
+      return NULL;
+   }
+   fanout->level = level;
+   fanout->type = MSGSEND_ALERT;
+   fanout->dept = strdup( dept );              // for the ack history (may fail, just not kept)
+   _msgSend_NoteLevel( alarm, level );         // stops retries of lower levels
+   return fanout;
+}
+
+
+/*-------------------------( _msgSend_NoteLevel )-------------------------
+
+  Remember the escalation level of the latest alert for an alarm.
+
+-----------------------------------------------------------------------*/
+
+void _msgSend_NoteLevel( int alarm, int level )
+{
+   int i;
+
+   pthread_mutex_lock( &msgSend_mutex );
+   for ( i = 0; i < MSGSEND_MAX_ALARMS && (alarm_levels[i].alarm != alarm || alarm_levels[i].level < 0); i++ );
+   if ( i == MSGSEND_MAX_ALARMS )
+   {
+      i = next_alarm_level;                     // replace oldest
+      next_alarm_level = (next_alarm_level + 1) % MSGSEND_MAX_ALARMS;
+      alarm_levels[i].alarm = alarm;
+   }
+   alarm_levels[i].level = level;
+   pthread_mutex_unlock( &msgSend_mutex );
+}
+
+
+/*-------------------------( _msgSend_Superseded )-------------------------
+
+  Check if an alert has been replaced by one at a higher escalation level.
+
+  Returns true if superseded
+------------------------------------------------------------------------*/
+
+int _msgSend_Superseded( msgSend_fanout_t *fanout )
+{
+   int ret = 0;
+   int i;
+
+   if ( fanout->alarm < 0 )
+   {
+      return 0;
+   }
+
+   pthread_mutex_lock( &msgSend_mutex );
+   for ( i = 0; i < MSGSEND_MAX_ALARMS; i++ )
+   {
+      if ( alarm_levels[i].alarm == fanout->alarm && alarm_levels[i].level > fanout->level )
+      {
+         ret = 1;
+         break;
+      }
+   }
+   pthread_mutex_unlock( &msgSend_mutex );
+
+   return ret;
+}
+
+
+/*-------------------------( _msgSend_Subscribed )-------------------------
+
+  Fan-out filter: phone covers the department (arg is the deptSub_t)
+
+------------------------------------------------------------------------*/
+
+int _msgSend_Subscribed( SPphone_record_t *phone, void *arg )
+{
+   return deptSub_Match( (deptSub_t *)arg, phone );
+}
+
+
+/*-------------------------( _msgSend_Recipient )-------------------------
+
+  Fan-out filter: phone was sent the alert, or is the one that accepted
+
+------------------------------------------------------------------------*/
+
+int _msgSend_Recipient( SPphone_record_t *phone, void *arg )
+{
+   recipFilter_t *recips = arg;
+
+   if ( recips->accept_ip != NULL && strncmp( recips->accept_ip, phone->ip_addr, strlen( phone->ip_addr )) == 0 )
+   {
+      return 1;
+   }
+   return bsearch( phone->ip_addr, recips->ips, recips->count, MAX_IP_ADDR+1, _msgSend_CompareIp ) != NULL;
+}
+
+
+/*-------------------------( _msgSend_InStage )-------------------------
+
+  Fan-out filter: phone is (or isn't) in the first stage of a
+  progressive alert, and covers the department
+
+----------------------------------------------------------------------*/
+
+int _msgSend_InStage( SPphone_record_t *phone, void *arg )
+{
+   stageFilter_t *stage = arg;
+
+   if ( stage->sub != NULL && !deptSub_Match( stage->sub, phone ))
+   {
+      return 0;
+   }
+   return (bsearch( phone->ip_addr, stage->ips, stage->count, MAX_IP_ADDR+1, _msgSend_CompareIp ) != NULL) == stage->first;
+}
+
+
+/*-------------------------( _msgSend_PickFirst )-------------------------
+
+  Pick the phones a progressive alert goes to first: the department's
+  phones with the best ack history.
+
+  Returns sorted array of MAX_IP_ADDR+1 byte addresses (caller frees),
+  NULL to send to all (no history, or not more phones than the first stage)
+-----------------------------------------------------------------------*/
+
+char *_msgSend_PickFirst( char *dept, deptSub_t *sub, int *count )
+{
+   SPphone_record_t *phone;
+   struct
+   {
+      double score;
+      char ip_addr[MAX_IP_ADDR+1];
+   }*cand;
+   char *ips = NULL;
+   int n = 0;
+   int i;
+
+   if ( ackRank_Known( dept ) == 0 ||
+        (cand = malloc( spRec_GetMaxPhones() * sizeof( *cand ))) == NULL )
+   {
+      return NULL;
+   }
+
+   phone = NULL;
+   while ( (phone = spRec_GetNextRecord( phone )) != NULL && n < spRec_GetMaxPhones() )
+   {
+      if ( sub == NULL || deptSub_Match( sub, phone ))
+      {
+         cand[n].score = ackRank_Score( dept, phone->ip_addr );
+         strcpy( cand[n].ip_addr, phone->ip_addr );
+         n++;
+      }
+   }
+
+   if ( n > progressive_first && (ips = malloc( progressive_first * (MAX_IP_ADDR+1) )) != NULL )
+   {
+      qsort( cand, n, sizeof( *cand ), _msgSend_CompareScore );
+      for ( i = 0; i < progressive_first; i++ )
+      {
+         strcpy( ips + i * (MAX_IP_ADDR+1), cand[i].ip_addr );
+      }
+      qsort( ips, progressive_first, MAX_IP_ADDR+1, _msgSend_CompareIp );
+      *count = progressive_first;
+   }
+   free( cand );
+   return ips;
+}
+
+
+int _msgSend_CompareScore( const void *a, const void *b )
+{
+   double sa = *(const double *)a;          // score is first in candidate
+   double sb = *(const double *)b;
+
+   return (sa < sb) ? 1 : (sa > sb) ? -1 : 0;     // best first
+}
+
+
+/*-------------------------( _msgSend_StageDone )-------------------------
+
+  First stage of a progressive alert is finished.  If none of those
+  phones got it, the rest get it now instead of after the wait.
+
+------------------------------------------------------------------------*/
+
+void _msgSend_StageDone( msgSend_fanout_t *fanout, void *data )
+{
+   widen_t *w;
+
+   if ( fanout->cancelled || fanout->n_ok != 0 )
+   {
+      return;
+   }
+
+   pthread_mutex_lock( &msgSend_mutex );
+   for ( w = widen_head; w != NULL && (w->alarm != fanout->alarm || w->level != fanout->level); w = w->next );
+   if ( w != NULL )
+   {
+      w->due_ms = 0;
+   }
+   pthread_mutex_unlock( &msgSend_mutex );
+
+   if ( w != NULL )
+   {
+      Log( INFO, "%s: Alarm %d didn't reach any of the first %d phones.  Sending to the rest\n", __func__, fanout->alarm, fanout->n_phones );
+      _msgSend_Wakeup();
+   }
+}
+
+
+/*-------------------------( _msgSend_DoWidens )-------------------------
+
+  Sender: send progressive alerts that weren't acked in time to the
+  rest of the phones.  Ones whose alarm has escalated since are dropped.
+
+  Returns ms until the next one is due, -1 if none waiting
+-----------------------------------------------------------------------*/
+
+long _msgSend_DoWidens( void )
+{
+   widen_t *w;
+   widen_t **pptr;
+   widen_t *due = NULL;
+   msgSend_fanout_t *fanout;
+   stageFilter_t stage;
+   long now = _msgSend_NowMs();
+   long wait_ms = -1;
+
+   pthread_mutex_lock( &msgSend_mutex );
+   pptr = &widen_head;
+   while ( (w = *pptr) != NULL )
+   {
+      if ( w->due_ms <= now )
+      {
+         *pptr = w->next;
+         w->next = due;
+         due = w;
+      }
+      else
+      {
+         if ( wait_ms < 0 || w->due_ms - now < wait_ms )
+         {
+            wait_ms = w->due_ms - now;
+         }
+         pptr = &w->next;
+      }
+   }
+   pthread_mutex_unlock( &msgSend_mutex );
+
+   while ( (w = due) != NULL )
+   {
+      due = w->next;
+      stage.sub = w->routed ? &w->sub : NULL;
+      stage.ips = w->ips;
+      stage.count = w->count;
+      stage.first = 0;
+
+      if ( (fanout = _msgSend_NewFanout( w->alarm, w->phone_cb, w->done_cb, w->cb_data )) != NULL )
+      {
+         fanout->level = w->level;
+         fanout->type = MSGSEND_ALERT;
+         fanout->dept = strdup( w->dept );
+         if ( _msgSend_Superseded( fanout ))
+         {
+            Log( DEBUG, "%s: Alarm %d escalated, not widening level %d\n", __func__, w->alarm, w->level );
+            fanout->done_cb = NULL;            // nothing to report
+            _msgSend_FanoutDone( fanout );
+         }
+         else
+         {
+            Log( INFO, "%s: Alarm %d not acked.  Sending to the rest of the phones\n", __func__, w->alarm );
+            _msgSend_PushMsgs( w->msg, NULL, NULL, fanout, _msgSend_InStage, &stage );
+         }
+      }
+      _msgSend_FreeWiden( w );
+   }
+
+   return wait_ms;
+}
+
+
+void _msgSend_FreeWiden( widen_t *w )
+{
+   msgBuf_Unref( w->msg );
+   free( w->ips );
+   free( w->dept );
+   free( w );
+}
+
+
+/*-------------------------( _msgSend_RecipUpdate )-------------------------
+
+  Track an alert push to a phone.  active is +1 when the push starts,
+  -1 when it ends.  got is true if it ended with the phone taking it
+  (or cancelled part way, so the phone might be showing it).
+
+-------------------------------------------------------------------------*/
+
+void _msgSend_RecipUpdate( pushXfer_t *xfer, int active, int got )
+{
+   alarmRecips_t *ar;
+   int i;
+
+   if ( xfer->fanout->alarm < 0 || xfer->fanout->level < 0 )
+   {
+      return;                              // not an alert
+   }
+
+   pthread_mutex_lock( &msgSend_mutex );
+   if ( (ar = _msgSend_FindRecips( xfer->fanout->alarm, active >= 0 )) != NULL &&
+        (i = _msgSend_RecipIndex( ar, xfer->ip_addr, active >= 0 )) >= 0 )
+   {
+      ar->phones[i].active += active;
+      ar->phones[i].got |= got;
+      ar->n_active += active;
+      ar->used_ms = _msgSend_NowMs();
+   }
+   pthread_mutex_unlock( &msgSend_mutex );
+}
+
+
+/*-------------------------( _msgSend_FindRecips )-------------------------
+
+  Find the recipient list for an alarm.  If create is set and it isn't
+  there, the free (or least recently used) slot is taken.  A list with
+  pushes still running is never taken.
+  msgSend_mutex must be held.
+
+  Returns list, NULL if not found
+------------------------------------------------------------------------*/
+
+alarmRecips_t *_msgSend_FindRecips( int alarm, int create )
+{
+   alarmRecips_t *oldest = NULL;
+   int i;
+
+   for ( i = 0; i < MSGSEND_MAX_ALARMS; i++ )
+   {
+      if ( alarm_recips[i].n_phones != 0 && alarm_recips[i].alarm == alarm )
+      {
+         return &alarm_recips[i];
+      }
+      if ( _msgSend_RecipsBusy( &alarm_recips[i] ))
+      {
+         continue;
+      }
+      if ( oldest == NULL || alarm_recips[i].n_phones == 0 ||
+           (oldest->n_phones != 0 && alarm_recips[i].used_ms < oldest->used_ms) )
+      {
+         oldest = &alarm_recips[i];
+      }
+   }
+
+   if ( !create || oldest == NULL )
+   {
+      if ( create )
+      {
+         Log( WARN, "%s: No room to track recipients of alarm %d\n", __func__, alarm );
+      }
+      return NULL;
+   }
+   oldest->alarm = alarm;
+   oldest->n_phones = 0;
+   oldest->n_active = 0;
+   return oldest;
+}
+
+
+// True if alert pushes are still running to any phone on the list
+
+int _msgSend_RecipsBusy( alarmRecips_t *ar )
+{
+   return (ar->n_phones != 0 && ar->n_active > 0);
+}
+
+
+/*-------------------------( _msgSend_RecipIndex )-------------------------
+
+  Find a phone in an alarm's recipient list by hash.  If create is set
+  and it isn't there, it is added.  The table and hash double when full.
+  msgSend_mutex must be held.
+
+  Returns index of phone in list, -1 if not found (or out of memory)
+------------------------------------------------------------------------*/
+
+int _msgSend_RecipIndex( alarmRecips_t *ar, char *ip_addr, int create )
+{
+   unsigned int h = _msgSend_IpHash( ip_addr );
+   alertRecip_t *tab;
+   int *buckets;
+   int size;
+   int i;
+
+   if ( ar->n_phones != 0 )
+   {
+      for ( i = ar->buckets[ h & (ar->n_buckets - 1) ]; i >= 0; i = ar->phones[i].next )
+      {
+         if ( strcmp( ar->phones[i].ip_addr, ip_addr ) == 0 )
+         {
+            return i;
+         }
+      }
+   }
+   if ( !create )
+   {
+      return -1;
+   }
+
+   if ( ar->n_phones == ar->max_phones )
+   {
+      size = (ar->max_phones == 0) ? 16 : ar->max_phones * 2;
+      if ( (buckets = realloc( ar->buckets, size * sizeof( int ))) != NULL )
+      {
+         ar->buckets = buckets;               // old hash still good until rebuilt
+      }
+      if ( buckets == NULL || (tab = realloc( ar->phones, size * sizeof( alertRecip_t ))) == NULL )
+      {
+         Log( ERROR, "%s: Can't grow recipient list for alarm %d!\n", __func__, ar->alarm );
+         return -1;
+      }
+      ar->phones = tab;
+      ar->max_phones = size;
+      ar->n_buckets = size;
+      memset( ar->buckets, 0xff, size * sizeof( int ));      // all -1
+      for ( i = 0; i < ar->n_phones; i++ )
+      {
+         h = _msgSend_IpHash( ar->phones[i].ip_addr ) & (size - 1);
+         ar->phones[i].next = ar->buckets[h];
+         ar->buckets[h] = i;
+      }
+      h = _msgSend_IpHash( ip_addr );
+   }
+   else if ( ar->n_phones == 0 )
+   {
+      memset( ar->buckets, 0xff, ar->n_buckets * sizeof( int ));   // list was reused
+   }
+
+   i = ar->n_phones++;
+   memset( &ar->phones[i], 0, sizeof( alertRecip_t ));
+   strcpy( ar->phones[i].ip_addr, ip_addr );
+   h &= ar->n_buckets - 1;
+   ar->phones[i].next = ar->buckets[h];
+   ar->buckets[h] = i;
+   return i;
+}
+
+
+/*-------------------------( _msgSend_GetRecips )-------------------------
+
+  Get a sorted copy of the phones that may be showing an alarm's alert.
+
+  Returns array of MAX_IP_ADDR+1 byte addresses (caller frees),
+  NULL if the alarm isn't known
+-----------------------------------------------------------------------*/
+
+char *_msgSend_GetRecips( int alarm, int *count )
+{
+   alarmRecips_t *ar;
+   char *ips = NULL;
+   int i;
+
+   *count = 0;
+   pthread_mutex_lock( &msgSend_mutex );
+   if ( (ar = _msgSend_FindRecips( alarm, 0 )) != NULL &&
+        (ips = malloc( ar->n_phones * (MAX_IP_ADDR+1) )) != NULL )
+   {
+      for ( i = 0; i < ar->n_phones; i++ )
+      {
+         if ( ar->phones[i].got || ar->phones[i].active > 0 )
+         {
+            strcpy( ips + (*count)++ * (MAX_IP_ADDR+1), ar->phones[i].ip_addr );
+         }
+      }
+   }
+   pthread_mutex_unlock( &msgSend_mutex );
+
+   if ( ips != NULL )
+   {
+      qsort( ips, *count, MAX_IP_ADDR+1, _msgSend_CompareIp );
+      Log( DEBUG, "%s: Alarm %d was sent to %d phones\n", __func__, alarm, *count );
+   }
+   return ips;
+}
+
+
+int _msgSend_CompareIp( const void *a, const void *b )
+{
+   return strcmp( (const char *)a, (const char *)b );
+}
+
+
+/*-------------------------( _msgSend_PushMsgs )-------------------------
+
+  Queue a push of msg to every phone in the table, or just the ones
+  the want filter picks if it isn't NULL.
+  If special_ip is given, that phone gets special_msg instead.
+  The fan-out takes a reference to the messages, and the pushes share
+  them without copying.  The fan-out's callbacks are called from the sender as the pushes
+  finish.  If there is nothing to send (or it can't be queued) the done
+  callback is called before returning.  The fan-out is freed when done.
+
+  Returns number of phones messages are being sent to.
+-----------------------------------------------------------------------*/
+
+int _msgSend_PushMsgs( msgBuf_t *msg, char *special_ip, msgBuf_t *special_msg, msgSend_fanout_t *fanout, pushFilter_t want, void *want_arg )
+{
+   SPphone_record_t *phone;                  // phone informatiion
+   pushXfer_t *xfer;
+   pushXfer_t *head = NULL;
+   pushXfer_t *tail = NULL;
+   pushXfer_t **pptr;
+   int count = 0;
+   int skipped = 0;
+   int i;
+
+   msgSend_Init();                           // make sure sender is running
+   _msgSend_ReadConfig();
+
+   // fan-out keeps the messages until every push is done
+   fanout->msg = msgBuf_Ref( msg );
+   fanout->special_msg = (special_msg != NULL) ? msgBuf_Ref( special_msg ) : NULL;
+   _msgSend_Digest( msg, fanout->msg_md5 );           // to tell if a phone is already showing it
+   if ( special_msg != NULL )
+   {
+      _msgSend_Digest( special_msg, fanout->special_md5 );
+   }
+
+   // create the transfers
+   phone = NULL;                             // start with first record
+   while( (phone = spRec_GetNextRecord( phone )) != NULL )
+   {
+      if ( want != NULL && !(*want)( phone, want_arg ))
+      {
+         continue;                            // not for this phone
+      }
+      if ( (xfer = calloc( 1, sizeof( pushXfer_t ))) == NULL )
+      {
+         Log( ERROR, "%s: Can't malloc transfer for %s!\n", __func__, phone->ip_addr );
+         continue;
+      }
+      strcpy( xfer->ip_addr, phone->ip_addr );  // IP address of phone to send to
+      xfer->net = _msgSend_Network( phone->ip_addr );
+
+      // check if special message for this IP
+      if ( (special_ip != NULL) && (strncmp( special_ip, phone->ip_addr, strlen( phone->ip_addr)) == 0 ))
+      {
+         xfer->msg = special_msg;                 // use special message
+         xfer->md5 = fanout->special_md5;
+      }
+      else
+      {
+         xfer->msg = msg;                         // message pointer
+         xfer->md5 = fanout->msg_md5;
+      }
+      xfer->fanout = fanout;
+      if ( fanout->type == MSGSEND_ALERT )
+      {
+         xfer->deadline_ms = fanout->start_ms + alert_delay_ms;    // next alert is out by then
+         xfer->due_ms = xfer->deadline_ms;
+      }
+      else
+      {
+         xfer->deadline_ms = fanout->start_ms + accept_limit_ms;
+         xfer->due_ms = fanout->start_ms;          // ahead of the alerts it clears
+      }
+
+      switch ( spConn_CheckBreaker( phone->ip_addr ) )
+      {
+         case SPCONN_SKIP:
+            xfer->probe = -1;                     // don't send
+            break;
+         case SPCONN_PROBE:
+            xfer->probe = 1;                      // quick check if phone is back
+            break;
+      }
+
+      if ( tail == NULL )
+      {
+         head = xfer;
+      }
+      else
+      {
+         tail->next = xfer;
+      }
+      tail = xfer;
+      count++;
+   }
+
+   // room for the results
+   if ( count != 0 && (fanout->results = calloc( count, sizeof( msgSend_phoneResult_t ))) == NULL )
+   {
+      Log( ERROR, "%s: Can't malloc results for %d phones!\n", __func__, count );
+      for ( xfer = head; xfer != NULL; xfer = head )
+      {
+         head = xfer->next;
+         if ( xfer->probe > 0 )
+         {
+            spConn_ProbeCancelled( xfer->ip_addr );   // probe never went out
+         }
+         free( xfer );
+      }
+      count = 0;
+   }
+
+   fanout->n_phones = count;
+   for ( xfer = head, i = 0; xfer != NULL; xfer = xfer->next, i++ )
+   {
+      xfer->res = &fanout->results[i];
+      strcpy( xfer->res->ip_addr, xfer->ip_addr );
+   }
+
+   // Take out phones the circuit breaker says to skip
+   pptr = &head;
+   tail = NULL;
+   while ( (xfer = *pptr) != NULL )
+   {
+      if ( xfer->probe < 0 )
+      {
+         *pptr = xfer->next;
+         xfer->res->result = MSGSEND_SKIPPED;
+         PLog( INFO, "Skipping unreachable phone %s\n", xfer->ip_addr );
+         free( xfer );
+         skipped++;
+      }
+      else
+      {
+         tail = xfer;
+         pptr = &xfer->next;
+      }
+   }
+   fanout->n_done = skipped;
+   fanout->n_tried = skipped;
+   count -= skipped;
+
+   if ( skipped != 0 )
+   {
+      pthread_mutex_lock( &msgSend_mutex );
+      stats.skipped += skipped;
+      pthread_mutex_unlock( &msgSend_mutex );
+   }
+
+   if ( head == NULL )
+   {
+      _msgSend_FanoutDone( fanout );          // nothing to send
+      return 0;
+   }
+
+   // hand them to the sender thread
+   pthread_mutex_lock( &msgSend_mutex );
+   if ( n_pending + count > max_queued_pushes )
+   {
+      pthread_mutex_unlock( &msgSend_mutex );
+      Log( WARN, "%s: Send queue full (%d waiting)! Dropping push to %d phones\n", __func__, n_pending, count );
+      for ( xfer = head; xfer != NULL; xfer = head )
+      {
+         head = xfer->next;
+         xfer->res->result = MSGSEND_FAILED;
+         if ( xfer->probe )
+         {
+            spConn_ProbeCancelled( xfer->ip_addr );   // probe never went out
+         }
+         free( xfer );
+      }
+      fanout->n_done = fanout->n_phones;
+      _msgSend_FanoutDone( fanout );
+      return 0;
+   }
+
+   _msgSend_QueueXfers( head, tail, count );
+   if ( n_pending > max_pending )
+   {
+      max_pending = n_pending;
+   }
+   pthread_mutex_unlock( &msgSend_mutex );
+
+   _msgSend_Wakeup();                     // get sender's attention
+
+   return count;            // return number of phones messages are being sent to
+}
+
+
+/*-------------------------( _msgSend_FanoutDone )-------------------------
+
+  Every push in a fan-out is finished.  Report it and free it.
+
+------------------------------------------------------------------------*/
+
+void _msgSend_FanoutDone( msgSend_fanout_t *fanout )
+{
+   if ( fanout->n_phones != 0 )
+   {
+      Log( DEBUG, "%s: Fan-out%s done: %d of %d phones OK in %ld ms\n", __func__,
+           (fanout->alarm >= 0) ? " for alarm" : "", fanout->n_ok, fanout->n_phones, _msgSend_NowMs() - fanout->start_ms );
+   }
+
+   if ( fanout->done_cb != NULL )
+   {
+      (*fanout->done_cb)( fanout, fanout->cb_data );
+   }
+   msgBuf_Unref( fanout->msg );
+   msgBuf_Unref( fanout->special_msg );
+   free( fanout->dept );
+   free( fanout->results );
+   free( fanout );
+}
+
+
+/*-------------------------( _msgSend_RunThread )-------------------------
+
+  Sender thread.  Drives all push transfers through the curl multi handle.
+  Should never exit.
+
+-----------------------------------------------------------------------*/
+
+void *_msgSend_RunThread( void *arg )
+{
+   int running;
+   long wait_ms;
+
+   while( 1 )
+   {
+      curl_multi_perform( multi_hnd, &running );
+
+      wait_ms = _msgSend_Service();
+
+      spConn_Evict();                          // close idle connections
+
+      if ( wait_ms < 0 || wait_ms > MSGSEND_POLL_MS )
+      {
+         wait_ms = MSGSEND_POLL_MS;
+      }
+      curl_multi_poll( multi_hnd, NULL, 0, (int)wait_ms, NULL );
+   }
+
+   return NULL;
+}
+
+
+/*-------------------------( _msgSend_Service )-------------------------
+
+  Finish completed transfers, do cancels and start waiting transfers.
+  Called from the sender thread or the server's event loop.
+
+  Returns ms until the next wave or retry, -1 if not waiting on one
+---------------------------------------------------------------------*/
+
+long _msgSend_Service( void )
+{
+   int left;
+   CURLMsg *m;
+   pushXfer_t *xfer;
+   struct timeval tv;
+   long wait_ms;
+   long retry_wait;
+   long widen_wait;
+
+   // Handle any finished transfers
+   while( (m = curl_multi_info_read( multi_hnd, &left )) != NULL )
+   {
+      if ( m->msg == CURLMSG_DONE )
+      {
+         curl_easy_getinfo( m->easy_handle, CURLINFO_PRIVATE, (char **)&xfer );
+         _msgSend_XferDone( xfer, m->data.result );
+      }
+   }
+
+   _msgSend_DoCancels();                    // drop pushes for accepted alarms
+
+   retry_wait = _msgSend_DoRetries();       // queue failed pushes that are due again
+
+   widen_wait = _msgSend_DoWidens();        // progressive alerts nobody acked
+   if ( widen_wait >= 0 && (retry_wait < 0 || widen_wait < retry_wait) )
+   {
+      retry_wait = widen_wait;
+   }
+
+   wait_ms = _msgSend_StartPending();       // start waiting transfers if room
+   if ( retry_wait >= 0 && (wait_ms < 0 || retry_wait < wait_ms) )
+   {
+      wait_ms = retry_wait;
+   }
+
+   if ( ev_base != NULL && wait_ms >= 0 )
+   {
+      tv.tv_sec = wait_ms / 1000;
+      tv.tv_usec = (wait_ms % 1000) * 1000;
+      evtimer_add( wave_ev, &tv );            // come back for next wave or retry
+   }
+   return wait_ms;
+}
+
+
+/*-------------------------( _msgSend_Wakeup )-------------------------
+
+  Get the sender to look at the pending list and cancels.
+  May be called from any thread.
+
+--------------------------------------------------------------------*/
+
+void _msgSend_Wakeup( void )
+{
+   if ( use_thread )
+   {
+      curl_multi_wakeup( multi_hnd );
+      return;
+   }
+
+   pthread_mutex_lock( &msgSend_mutex );
+   if ( wake_ev != NULL )
+   {
+      event_active( wake_ev, 0, 0 );           // server loop isn't up yet if NULL
+   }
+   pthread_mutex_unlock( &msgSend_mutex );
+}
+
+
+/*-------------------------( _msgSend_SocketCB )-------------------------
+
+  curl wants a socket watched (or not watched anymore) by the event loop.
+  The socket's event is kept with curl_multi_assign.
+
+----------------------------------------------------------------------*/
+
+int _msgSend_SocketCB( CURL *hnd, curl_socket_t sock, int what, void *userp, void *sockp )
+{
+   struct event *ev = sockp;
+   short kind;
+
+   if ( what == CURL_POLL_REMOVE )
+   {
+      if ( ev != NULL )
+      {
+         event_free( ev );
+         curl_multi_assign( multi_hnd, sock, NULL );
+      }
+      return 0;
+   }
+
+   kind = EV_PERSIST | ((what & CURL_POLL_IN) ? EV_READ : 0) | ((what & CURL_POLL_OUT) ? EV_WRITE : 0);
+   if ( ev == NULL )
+   {
+      ev = event_new( ev_base, sock, kind, _msgSend_EventCB, NULL );
+      curl_multi_assign( multi_hnd, sock, ev );
+   }
+   else
+   {
+      event_del( ev );
+      event_assign( ev, ev_base, sock, kind, _msgSend_EventCB, NULL );
+   }
+   event_add( ev, NULL );
+   return 0;
+}
+
+
+/*-------------------------( _msgSend_TimerCB )-------------------------
+
+  curl wants to be called back after timeout_ms (-1 to cancel).
+
+---------------------------------------------------------------------*/
+
+int _msgSend_TimerCB( CURLM *multi, long timeout_ms, void *userp )
+{
+   struct timeval tv;
+
+   if ( timeout_ms < 0 )
+   {
+      evtimer_del( timer_ev );
+   }
+   else
+   {
+      tv.tv_sec = timeout_ms / 1000;
+      tv.tv_usec = (timeout_ms % 1000) * 1000;
+      evtimer_add( timer_ev, &tv );
+   }
+   return 0;
+}
+
+
+/*-------------------------( _msgSend_EventCB )-------------------------
+
+  Event loop: a socket curl is watching is ready.
+
+---------------------------------------------------------------------*/
+
+void _msgSend_EventCB( evutil_socket_t fd, short what, void *arg )
+{
+   int action = ((what & EV_READ) ? CURL_CSELECT_IN : 0) | ((what & EV_WRITE) ? CURL_CSELECT_OUT : 0);
+   int running;
+
+   curl_multi_socket_action( multi_hnd, fd, action, &running );
+   _msgSend_Service();
+}
+
+
+/*-------------------------( _msgSend_TimeoutCB )-------------------------
+
+  Event loop: curl's timeout is up.
+
+-----------------------------------------------------------------------*/
+
+void _msgSend_TimeoutCB( evutil_socket_t fd, short what, void *arg )
+{
+   int running;
+
+   curl_multi_socket_action( multi_hnd, CURL_SOCKET_TIMEOUT, 0, &running );
+   _msgSend_Service();
+}
+
+
+/*-------------------------( _msgSend_WakeCB )-------------------------
+
+  Event loop: pushes were queued or cancelled from another thread.
+
+--------------------------------------------------------------------*/
+
+void _msgSend_WakeCB( evutil_socket_t fd, short what, void *arg )
+{
+   _msgSend_Service();
+}
+
+
+/*-------------------------( _msgSend_TickCB )-------------------------
+
+  Event loop: once a second, close idle connections.
+
+--------------------------------------------------------------------*/
+
+void _msgSend_TickCB( evutil_socket_t fd, short what, void *arg )
+{
+   spConn_Evict();
+}
+
+
+/*-------------------------( _msgSend_StartPending )-------------------------
+
+  Move pending transfers into the multi handle, up to the
+  max number of active transfers.  Transfers are started in order,
+  except ones for a subnet that is at its limit wait their turn
+  without holding up the others.
+
+  Returns ms until the next wave can start, -1 if not waiting on one
+--------------------------------------------------------------------------*/
+
+long _msgSend_StartPending( void )
+{
+   pushXfer_t *xfer;
+   pushXfer_t *prev;
+   pushXfer_t *parked;
+   pushXfer_t **park_tail;
+   pushXfer_t *expired;
+   pushXfer_t *out;
+   phoneBox_t *box;
+   CURL *hnd;
+   long now = _msgSend_NowMs();
+   long wait_ms = -1;
+   long t;
+
+   while ( n_active < max_active_pushes )
+   {
+      parked = NULL;
+      park_tail = &parked;
+      expired = NULL;
+
+      pthread_mutex_lock( &msgSend_mutex );
+      prev = NULL;
+      xfer = pending_head;
+      while ( xfer != NULL )
+      {
+         if ( xfer->deadline_ms <= now || ((box = _msgSend_FindBox( xfer->ip_addr, 0 )) != NULL && box->busy != xfer) )
+         {
+            // Too late, or phone busy (wait in its mailbox)
+            if ( prev == NULL )
+            {
+               pending_head = xfer->next;
+            }
+            else
+            {
+               prev->next = xfer->next;
+            }
+            if ( pending_tail == xfer )
+            {
+               pending_tail = prev;
+            }
+            n_pending--;
+            out = xfer;
+            xfer = xfer->next;
+            if ( out->deadline_ms <= now )
+            {
+               out->next = expired;
+               expired = out;
+            }
+            else
+            {
+               *park_tail = out;
+               park_tail = &out->next;
+            }
+            continue;
+         }
+         if ( (t = _msgSend_GroupWait( xfer, now )) == 0 )
+         {
+            break;                     // this one can go
+         }
+         if ( t > 0 && (wait_ms < 0 || t < wait_ms) )
+         {
+            wait_ms = t;
+         }
+         prev = xfer;
+         xfer = xfer->next;
+      }
+      if ( xfer != NULL )
+      {
+         if ( prev == NULL )
+         {
+            pending_head = xfer->next;
+         }
+         else
+         {
+            prev->next = xfer->next;
+         }
+         if ( pending_tail == xfer )
+         {
+            pending_tail = prev;
+         }
+         n_pending--;
+      }
+      pthread_mutex_unlock( &msgSend_mutex );
+      *park_tail = NULL;
+
+      while ( (out = parked) != NULL )
+      {
+         parked = out->next;
+         _msgSend_BoxPost( _msgSend_FindBox( out->ip_addr, 0 ), out );
+      }
+
+      while ( (out = expired) != NULL )
+      {
+         expired = out->next;
+         Log( DEBUG, "%s: Deadline passed, dropping push to %s\n", __func__, out->ip_addr );
+         if ( out->probe )
+         {
+            spConn_ProbeCancelled( out->ip_addr );
+         }
+         _msgSend_XferFinish( out, MSGSEND_EXPIRED, 0 );
+      }
+
+      if ( xfer == NULL )
+      {
+         break;                        // nothing that can go now
+      }
+      xfer->next = NULL;
+
+      // Phone is idle, so what it took last is what it shows
+      if ( !force_realert && spConn_IsShown( xfer->ip_addr, xfer->fanout->about, xfer->fanout->level, xfer->fanout->type, xfer->md5 ))
+      {
+         Log( DEBUG, "%s: %s already showing it\n", __func__, xfer->ip_addr );
+         _msgSend_RecipUpdate( xfer, 0, 1 );
+         _msgSend_XferFinish( xfer, MSGSEND_UNCHANGED, 0 );
+         continue;
+      }
+
+      if ( (hnd = xfer->hnd = spConn_GetHandle( xfer->ip_addr )) == NULL )
+      {
+         Log( ERROR, "%s: Can't get curl handle for %s!\n", __func__, xfer->ip_addr );
+         _msgSend_XferDone( xfer, CURLE_OUT_OF_MEMORY );
+         continue;
+      }
+
+      // count it against its subnet
+      if ( (xfer->group = _msgSend_FindGroup( xfer->net )) != NULL )
+      {
+         if ( now - xfer->group->wave_start >= group_wave_ms )
+         {
+            xfer->group->wave_start = now;         // new wave
+            xfer->group->wave_count = 0;
+         }
+         xfer->group->wave_count++;
+         xfer->group->active++;
+      }
+
+      if ( (box = _msgSend_FindBox( xfer->ip_addr, 1 )) != NULL )
+      {
+         box->busy = xfer;                      // phone busy until this one is done
+      }
+
+      _msgSend_XferSetup( xfer );
+      Log( DEBUG, "%s: Sending to %s\n", __func__, xfer->ip_addr );
+      curl_multi_add_handle( multi_hnd, hnd );
+      _msgSend_RecipUpdate( xfer, 1, 0 );      // phone may show it from now on
+      n_active++;
+      xfer->next = active_head;                // onto active list
+      active_head = xfer;
+   }
+
+   return wait_ms;
+}
+
+
+/*-------------------------( _msgSend_GroupWait )-------------------------
+
+  Check if a transfer's subnet has room for another push.
+
+  Returns 0 if it can start now, ms until next wave if the
+  current wave is used up, -1 if waiting for pushes to finish
+-----------------------------------------------------------------------*/
+
+long _msgSend_GroupWait( pushXfer_t *xfer, long now )
+{
+   pushGroup_t *group;
+   long age;
+
+   if ( (group = _msgSend_FindGroup( xfer->net )) == NULL )
+   {
+      return 0;                        // not tracked, no limit
+   }
+   if ( group->active >= group_max_active )
+   {
+      return -1;
+   }
+   age = now - group->wave_start;
+   if ( group_wave_ms <= 0 || age >= group_wave_ms || group->wave_count < group_wave_size )
+   {
+      return 0;
+   }
+   return group_wave_ms - age;
+}
+
+
+/*-------------------------( _msgSend_FindGroup )-------------------------
+
+  Find the group for a subnet, adding it if not there.
+  If the table is full, an idle group is reused.
+
+  Returns the group, NULL if table full of busy groups
+-----------------------------------------------------------------------*/
+
+pushGroup_t *_msgSend_FindGroup( uint32_t net )
+{
+   pushGroup_t *idle = NULL;
+   int i;
+
+   for ( i = 0; i < n_groups; i++ )
+   {
+      if ( groups[i].net == net )
+      {
+         return &groups[i];
+      }
+      if ( groups[i].active == 0 && idle == NULL )
+      {
+         idle = &groups[i];
+      }
+   }
+
+   if ( n_groups < MSGSEND_MAX_GROUPS )
+   {
+      idle = &groups[ n_groups++ ];
+   }
+   if ( idle != NULL )
+   {
+      memset( idle, 0, sizeof( pushGroup_t ));
+      idle->net = net;
+      idle->wave_start = -group_wave_ms;      // first wave can start right away
+   }
+   return idle;
+}
+
+
+/*-------------------------( _msgSend_Network )-------------------------
+
+  Get the subnet a phone is on from its address ("a.b.c.d" or "a.b.c.d:port").
+
+  Returns network part of address (host order), 0 if not an IPv4 address
+---------------------------------------------------------------------*/
+
+uint32_t _msgSend_Network( char *ip_addr )
+{
+   char buf[MAX_IP_ADDR+1];
+   struct in_addr addr;
+   char *ptr;
+
+   strncpy( buf, ip_addr, MAX_IP_ADDR );
+   buf[MAX_IP_ADDR] = '\0';
+   if ( (ptr = strchr( buf, ':' )) != NULL )
+   {
+      *ptr = '\0';                     // drop port
+   }
+   if ( inet_aton( buf, &addr ) == 0 )
+   {
+      return 0;
+   }
+   return ntohl( addr.s_addr ) & group_mask;
+}
+
+
+/*-------------------------( _msgSend_XferSetup )-------------------------
+
+  Set the curl options for a push.
+  If we have a nonce cached for the phone, send the digest credentials
+  up front, else let curl answer the phone's challenge.
+
+-----------------------------------------------------------------------*/
+
+void _msgSend_XferSetup( pushXfer_t *xfer )
+{
+   CURL *hnd = xfer->hnd;
+   char authHdr[ 400 ];
+   long connect_ms;
+   long total_ms;
+
+   // Create OPT with given IP address
+   snprintf( xfer->url, sizeof( xfer->url ), "%s://%s" MSGSEND_PUSH_URI, use_https ? "https" : "http", xfer->ip_addr );
+   curl_easy_setopt(hnd, CURLOPT_URL, xfer->url );
+
+   curl_slist_free_all( xfer->headers );
+   xfer->headers = NULL;
+   *xfer->challenge = '\0';
+
+   if ( spConn_MakeAuth( xfer->ip_addr, MSGSEND_PUSH_URI, username, authHdr, sizeof( authHdr )) == 0 )
+   {
+      xfer->headers = curl_slist_append( NULL, authHdr );       // preemptive digest
+      xfer->preemptive = 1;
+      // Our Authorization header stops curl sending Basic credentials.  Leaving
+      // them set keeps curl from treating a reused connection as mid-negotiation
+      // (it would send an empty body)
+      curl_easy_setopt(hnd, CURLOPT_USERPWD, authentication );
+      curl_easy_setopt(hnd, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+   }
+   else
+   {
+      xfer->preemptive = 0;
+      curl_easy_setopt(hnd, CURLOPT_USERPWD, authentication );
+      curl_easy_setopt(hnd, CURLOPT_HTTPAUTH, CURLAUTH_DIGEST);
+   }
+   curl_easy_setopt(hnd, CURLOPT_HTTPHEADER, xfer->headers );
+
+   if ( xfer->msg->n_iov > 0 )
+   {
+      // Gathered message, curl reads it from the pieces
+      xfer->sent = 0;
+      curl_easy_setopt(hnd, CURLOPT_POSTFIELDS, NULL);
+      curl_easy_setopt(hnd, CURLOPT_POST, 1L);
+      curl_easy_setopt(hnd, CURLOPT_READFUNCTION, _msgSend_ReadCallback );
+      curl_easy_setopt(hnd, CURLOPT_READDATA, xfer );
+      curl_easy_setopt(hnd, CURLOPT_SEEKFUNCTION, _msgSend_SeekCallback ); // to send again after a challenge
+      curl_easy_setopt(hnd, CURLOPT_SEEKDATA, xfer );
+   }
+   else
+   {
+      curl_easy_setopt(hnd, CURLOPT_POSTFIELDS, (char *)xfer->msg->data);  // shared, not copied
+   }
+   curl_easy_setopt(hnd, CURLOPT_POSTFIELDSIZE, (long)xfer->msg->len);
+   curl_easy_setopt(hnd, CURLOPT_USERAGENT, "curl/7.22.0 (x86_64-pc-linux-gnu) libcurl/7.22.0 OpenSSL/1.0.1 zlib/1.2.3.4 libidn/1.23 librtmp/2.3");
+
+   // Timeouts from phone's round trip times, limited by phone_timeout
+   spConn_GetTimeouts( xfer->ip_addr, net_timeout * 1000L, &connect_ms, &total_ms );
+   if ( xfer->probe && connect_ms > spConn_ProbeTimeout() )
+   {
+      connect_ms = spConn_ProbeTimeout();                              // probes give up fast
+   }
+   xfer->short_timeout = (!xfer->probe && (total_ms < net_timeout * 1000L || connect_ms < total_ms));
+   curl_easy_setopt(hnd, CURLOPT_TIMEOUT_MS, total_ms );
+   curl_easy_setopt(hnd, CURLOPT_CONNECTTIMEOUT_MS, connect_ms );
+   curl_easy_setopt(hnd, CURLOPT_WRITEFUNCTION, _msgSend_WriteCallback );   // Set the received data callback function
+   curl_easy_setopt(hnd, CURLOPT_WRITEDATA, xfer );                    // Structure to send to callback function
+   curl_easy_setopt(hnd, CURLOPT_HEADERFUNCTION, _msgSend_HeaderCallback ); // Watch for digest challenges
+   curl_easy_setopt(hnd, CURLOPT_HEADERDATA, xfer );
+   curl_easy_setopt(hnd, CURLOPT_NOSIGNAL, 1L);                        // shut off signals (to avoid "Alarm clock" in pthreads)
+   curl_easy_setopt(hnd, CURLOPT_PRIVATE, xfer );                      // so we can find the transfer when done
+   spConn_SetOpts( hnd, xfer->ip_addr );                               // track connections so they can be reused
+}
+
+
+/*-------------------------( _msgSend_XferDone )-------------------------
+
+  A transfer has finished.  Report it and clean up.
+
+-----------------------------------------------------------------------*/
+
+void _msgSend_XferDone( pushXfer_t *xfer, CURLcode ret )
+{
+   curl_off_t connect_us = 0;
+   curl_off_t total_us = 0;
+   long httpCode = 0L;
+   int result;
+
+   if ( ret != CURLE_OK )
+   {
+      Log( DEBUG, "%s: Failed on connection \"%s\": error: %d, %s\n", __func__, xfer->ip_addr, ret, curl_easy_strerror(ret) );
+      result = MSGSEND_FAILED;
+      if ( ret == CURLE_OPERATION_TIMEDOUT )
+      {
+         spConn_RttBackoff( xfer->ip_addr );           // full timeout next time
+      }
+   }
+   else
+   {
+      curl_easy_getinfo( xfer->hnd, CURLINFO_RESPONSE_CODE, &httpCode );       // Get the HTTP response code
+      result = (httpCode == 200) ? MSGSEND_OK : MSGSEND_REJECTED;
+
+      if ( result == MSGSEND_OK )
+      {
+         curl_easy_getinfo( xfer->hnd, CURLINFO_CONNECT_TIME_T, &connect_us );
+         curl_easy_getinfo( xfer->hnd, CURLINFO_TOTAL_TIME_T, &total_us );
+         spConn_RttSample( xfer->ip_addr, (long)(connect_us / 1000), (long)(total_us / 1000) );
+      }
+
+      if ( httpCode == 401 && xfer->preemptive && !xfer->auth_retry )
+      {
+         // Cached nonce went stale.  Answer the new challenge and send again
+         Log( DEBUG, "%s: Nonce for %s rejected, retrying\n", __func__, xfer->ip_addr );
+         if ( *xfer->challenge == '\0' || spConn_SaveChallenge( xfer->ip_addr, xfer->challenge, username, password, 0 ) != 0 )
+         {
+            spConn_ClearAuth( xfer->ip_addr );          // fall back to curl's challenge handling
+         }
+         xfer->auth_retry = 1;
+         curl_multi_remove_handle( multi_hnd, xfer->hnd );
+         _msgSend_XferSetup( xfer );
+         curl_multi_add_handle( multi_hnd, xfer->hnd );
+         return;
+      }
+
+      if ( httpCode == 200 && !xfer->preemptive && *xfer->challenge != '\0' )
+      {
+         // curl answered the challenge with nonce count 1. Cache it for next time
+         spConn_SaveChallenge( xfer->ip_addr, xfer->challenge, username, password, 1 );
+      }
+      else if ( httpCode == 401 )
+      {
+         spConn_ClearAuth( xfer->ip_addr );
+      }
+   }
+
+   // A timeout cut short from the phone's round trip times only means
+   // it was slower than usual, so it doesn't count against the breaker.
+   // The next try waits the full phone_timeout, and counts if it fails.
+   if ( result != MSGSEND_FAILED ||
+        (ret != CURLE_OUT_OF_MEMORY && (ret != CURLE_OPERATION_TIMEDOUT || !xfer->short_timeout)) )
+   {
+      spConn_PushResult( xfer->ip_addr, result != MSGSEND_FAILED );     // circuit breaker
+   }
+
+   if ( result == MSGSEND_FAILED && ret != CURLE_OUT_OF_MEMORY && _msgSend_RetryLater( xfer ))
+   {
+      return;                          // will send again
+   }
+
+   _msgSend_XferFinish( xfer, result, httpCode );
+}
+
+
+/*-------------------------( _msgSend_RetryLater )-------------------------
+
+  Put a failed alert push on the retry list.  The delay doubles each
+  try, with jitter so phones that failed together don't retry together.
+  Gives up if the retry wouldn't go out before the next alert is due.
+
+  Returns true if it will be retried
+-----------------------------------------------------------------------*/
+
+int _msgSend_RetryLater( pushXfer_t *xfer )
+{
+   msgSend_fanout_t *fanout = xfer->fanout;
+   long delay;
+   long now;
+
+   if ( fanout->alarm < 0 || ++xfer->tries >= max_push_tries || retry_base_ms <= 0 )
+   {
+      return 0;
+   }
+
+   delay = (long)retry_base_ms << (xfer->tries - 1);
+   if ( delay > retry_max_ms )
+   {
+      delay = retry_max_ms;
+   }
+   delay = delay / 2 + random() % (delay / 2 + 1);     // somewhere in the upper half
+
+   now = _msgSend_NowMs();
+   if ( now + delay >= fanout->start_ms + alert_delay_ms || _msgSend_Superseded( fanout ))
+   {
+      return 0;                        // too late to matter
+   }
+
+   Log( DEBUG, "%s: Retrying alarm %d to %s in %ld ms (try %d)\n", __func__, fanout->alarm, xfer->ip_addr, delay, xfer->tries + 1 );
+   spConn_ClearShown( xfer->ip_addr );          // don't know what it shows now
+   _msgSend_XferRelease( xfer, 0 );
+   _msgSend_BoxDone( xfer );                    // let the phone's next push go meanwhile
+   xfer->retry_ms = now + delay;
+   xfer->auth_retry = 0;
+   xfer->probe = 0;
+   xfer->next = retry_head;
+   retry_head = xfer;
+
+   pthread_mutex_lock( &msgSend_mutex );
+   stats.retried++;
+   pthread_mutex_unlock( &msgSend_mutex );
+
+   _msgSend_FirstTryOver( xfer, 0 );
+   return 1;
+}
+
+
+/*-------------------------( _msgSend_DoRetries )-------------------------
+
+  Sender: queue retries that are due.  Ones whose alarm has
+  escalated since are dropped.
+
+  Returns ms until the next retry is due, -1 if none waiting
+-----------------------------------------------------------------------*/
+
+long _msgSend_DoRetries( void )
+{
+   pushXfer_t *xfer;
+   pushXfer_t **pptr;
+   long now = _msgSend_NowMs();
+   long wait_ms = -1;
+
+   pptr = &retry_head;
+   while ( (xfer = *pptr) != NULL )
+   {
+      if ( _msgSend_Superseded( xfer->fanout ))
+      {
+         *pptr = xfer->next;
+         Log( DEBUG, "%s: Alarm %d escalated, dropping retry to %s\n", __func__, xfer->fanout->alarm, xfer->ip_addr );
+         _msgSend_XferFinish( xfer, MSGSEND_CANCELLED, 0 );
+      }
+      else if ( xfer->retry_ms <= now )
+      {
+         *pptr = xfer->next;
+         switch ( spConn_CheckBreaker( xfer->ip_addr ) )
+         {
+            case SPCONN_SKIP:
+               _msgSend_XferFinish( xfer, MSGSEND_SKIPPED, 0 );    // still unreachable, not sent
+               continue;
+            case SPCONN_PROBE:
+               xfer->probe = 1;
+               break;
+         }
+
+         pthread_mutex_lock( &msgSend_mutex );
+         _msgSend_QueueXfers( xfer, xfer, 1 );
+         pthread_mutex_unlock( &msgSend_mutex );
+      }
+      else
+      {
+         if ( wait_ms < 0 || xfer->retry_ms - now < wait_ms )
+         {
+            wait_ms = xfer->retry_ms - now;
+         }
+         pptr = &xfer->next;
+      }
+   }
+
+   return wait_ms;
+}
+
+
+/*-------------------------( _msgSend_XferRelease )-------------------------
+
+  Take a transfer out of the multi handle and give its handle back.
+  got is true if the phone may be showing the message.
+
+-------------------------------------------------------------------------*/
+
+void _msgSend_XferRelease( pushXfer_t *xfer, int got )
+{
+   pushXfer_t **pptr;
+
+   if ( xfer->hnd != NULL )
+   {
+      _msgSend_RecipUpdate( xfer, -1, got );
+      curl_multi_remove_handle( multi_hnd, xfer->hnd );
+      n_active--;
+      for ( pptr = &active_head; *pptr != NULL; pptr = &(*pptr)->next )
+      {
+         if ( *pptr == xfer )
+         {
+            *pptr = xfer->next;        // take off active list
+            break;
+         }
+      }
+      if ( xfer->group != NULL )
+      {
+         xfer->group->active--;
+      }
+      curl_easy_setopt( xfer->hnd, CURLOPT_HTTPHEADER, NULL );
+      spConn_PutHandle( xfer->ip_addr, xfer->hnd );     // keep handle (and its connection) for next push
+      xfer->hnd = NULL;
+      xfer->group = NULL;
+   }
+   curl_slist_free_all( xfer->headers );
+   xfer->headers = NULL;
 }
 
+
+/*-------------------------( _msgSend_XferFinish )-------------------------
+
+  Release a transfer's handle, record its result in the fan-out
+  and free it.
+
+-----------------------------------------------------------------------*/
+
+void _msgSend_XferFinish( pushXfer_t *xfer, int result, long httpCode )
+{
+   msgSend_fanout_t *fanout;
+
+   // Keep track of what the phone is showing
+   if ( result == MSGSEND_OK )
+   {
+      spConn_SetShown( xfer->ip_addr, xfer->fanout->about, xfer->fanout->level, xfer->fanout->type, xfer->md5 );
+      if ( xfer->fanout->dept != NULL )
+      {
+         ackRank_Delivered( xfer->fanout->dept, xfer->fanout->alarm, xfer->ip_addr );
+      }
+   }
+   else if ( xfer->hnd != NULL )
+   {
+      spConn_ClearShown( xfer->ip_addr );     // may have got some of it
+   }
+
+   _msgSend_XferRelease( xfer, result == MSGSEND_OK || result == MSGSEND_CANCELLED );
+   _msgSend_BoxDone( xfer );
+
+   pthread_mutex_lock( &msgSend_mutex );
+   switch ( result )
+   {
+      case MSGSEND_OK:        stats.sent++; stats.ok++; break;
+      case MSGSEND_REJECTED:  stats.sent++; stats.rejected++; break;
+      case MSGSEND_SKIPPED:   stats.skipped++; break;
+      case MSGSEND_CANCELLED: stats.cancelled++; break;
+      case MSGSEND_UNCHANGED: stats.unchanged++; break;
+      case MSGSEND_EXPIRED:   stats.expired++; break;
+      default:                stats.sent++; stats.failed++; break;
+   }
+   pthread_mutex_unlock( &msgSend_mutex );
+
+   // Record result for the fan-out
+   fanout = xfer->fanout;
+   xfer->res->result = result;
+   xfer->res->httpCode = httpCode;
+   xfer->res->latency_ms = (int)(_msgSend_NowMs() - fanout->start_ms);
+   _msgSend_LogResult( xfer->res );
+
+   if ( fanout->phone_cb != NULL )
+   {
+      (*fanout->phone_cb)( xfer->res, fanout->cb_data );
+   }
+
+   if ( result == MSGSEND_OK || result == MSGSEND_UNCHANGED )
+   {
+      fanout->n_ok++;                          // phone has it
+   }
+   else if ( result == MSGSEND_CANCELLED )
+   {
+      fanout->cancelled = 1;
+   }
+   _msgSend_FirstTryOver( xfer, 1 );
+   free( xfer );
+
+   if ( ++fanout->n_done == fanout->n_phones )
+   {
+      _msgSend_FanoutDone( fanout );
+   }
+}
+
+
+/*-------------------------( msgSend_CancelAlarm )-------------------------
+
+  Cancel all waiting, running and retrying alert pushes for an alarm.
+  The sender thread does the cancel before it starts any pushes
+  queued after this call.
+
+------------------------------------------------------------------------*/
+
+void msgSend_CancelAlarm( int alarm )
+{
+   msgSend_Init();                           // make sure sender is running
+
+   pthread_mutex_lock( &msgSend_mutex );
+   if ( n_cancels < MSGSEND_MAX_CANCELS )
+   {
+      cancel_alarms[ n_cancels++ ] = alarm;
+   }
+   else
+   {
+      Log( WARN, "%s: Too many cancels waiting. Alarm %d not cancelled\n", __func__, alarm );
+   }
+   pthread_mutex_unlock( &msgSend_mutex );
+
+   _msgSend_Wakeup();
+}
+
+
+/*-------------------------( _msgSend_DoCancels )-------------------------
+
+  Sender thread: cancel the pushes for any alarms asked for.
+
+-----------------------------------------------------------------------*/
+
+void _msgSend_DoCancels( void )
+{
+   int alarms[ MSGSEND_MAX_CANCELS ];
+   int n, i;
+   pushXfer_t *xfer;
+   pushXfer_t *next;
+   pushXfer_t *cancelled = NULL;
+   pushXfer_t **pptr;
+   phoneBox_t *box;
+   unsigned int b;
+   widen_t *w;
+   widen_t **wptr;
+   widen_t *dropped = NULL;
+
+   pthread_mutex_lock( &msgSend_mutex );
+   n = n_cancels;
+   memcpy( alarms, cancel_alarms, n * sizeof( int ));
+   n_cancels = 0;
+
+   if ( n != 0 )
+   {
+      // Take cancelled ones out of the pending list
+      pending_tail = NULL;
+      pptr = &pending_head;
+      while ( (xfer = *pptr) != NULL )
+      {
+         for ( i = 0; i < n && xfer->fanout->alarm != alarms[i]; i++ );
+         if ( i < n )
+         {
+            *pptr = xfer->next;
+            xfer->next = cancelled;
+            cancelled = xfer;
+            n_pending--;
+         }
+         else
+         {
+            pending_tail = xfer;
+            pptr = &xfer->next;
+         }
+      }
+
+      // Progressive alerts don't need to go any wider
+      wptr = &widen_head;
+      while ( (w = *wptr) != NULL )
+      {
+         for ( i = 0; i < n && w->alarm != alarms[i]; i++ );
+         if ( i < n )
+         {
+            *wptr = w->next;
+            w->next = dropped;
+            dropped = w;
+         }
+         else
+         {
+            wptr = &w->next;
+         }
+      }
+   }
+   pthread_mutex_unlock( &msgSend_mutex );
+
+   while ( (w = dropped) != NULL )
+   {
+      dropped = w->next;
+      _msgSend_FreeWiden( w );
+   }
+
+   if ( n == 0 )
+   {
+      return;
+   }
+
+   // Take them out of the phone mailboxes first.  Finishing a pending
+   // or running push moves the phone's next waiting push to the pending
+   // list, where this would miss it.
+   for ( b = 0; b < box_size; b++ )
+   {
+      for ( box = box_tab[b]; box != NULL; box = box->next )
+      {
+         pptr = &box->waiting;
+         while ( (xfer = *pptr) != NULL )
+         {
+            for ( i = 0; i < n && xfer->fanout->alarm != alarms[i]; i++ );
+            if ( i < n )
+            {
+               *pptr = xfer->next;
+               if ( xfer->probe )
+               {
+                  spConn_ProbeCancelled( xfer->ip_addr );
+               }
+               _msgSend_XferFinish( xfer, MSGSEND_CANCELLED, 0 );
+            }
+            else
+            {
+               pptr = &xfer->next;
+            }
+         }
+      }
+   }
+
+   // Then the ones taken out of the pending list
+   for ( xfer = cancelled; xfer != NULL; xfer = next )
+   {
+      next = xfer->next;
+      if ( xfer->probe )
+      {
+         spConn_ProbeCancelled( xfer->ip_addr );
+      }
+      _msgSend_XferFinish( xfer, MSGSEND_CANCELLED, 0 );
+   }
+
+   // Stop the running ones
+   for ( xfer = active_head; xfer != NULL; xfer = next )
+   {
+      next = xfer->next;
+      for ( i = 0; i < n && xfer->fanout->alarm != alarms[i]; i++ );
+      if ( i < n )
+      {
+         Log( DEBUG, "%s: Cancelling push of alarm %d to %s\n", __func__, alarms[i], xfer->ip_addr );
+         if ( xfer->probe )
+         {
+            spConn_ProbeCancelled( xfer->ip_addr );
+         }
+         _msgSend_XferFinish( xfer, MSGSEND_CANCELLED, 0 );
+      }
+   }
+
+   // And the ones waiting to retry
+   pptr = &retry_head;
+   while ( (xfer = *pptr) != NULL )
+   {
+      for ( i = 0; i < n && xfer->fanout->alarm != alarms[i]; i++ );
+      if ( i < n )
+      {
+         *pptr = xfer->next;
+         _msgSend_XferFinish( xfer, MSGSEND_CANCELLED, 0 );
+      }
+      else
+      {
+         pptr = &xfer->next;
+      }
+   }
+
+   for ( i = 0; i < n; i++ )
+   {
+      Log( DEBUG, "%s: Cancelled pushes for alarm %d\n", __func__, alarms[i] );
+   }
+}
+
+
+/*-------------------------( _msgSend_QueueXfers )-------------------------
+
+  Put a list of transfers (all due at the same time) on the pending
+  list, after the ones due no later.  Alerts are due at their deadline;
+  accepts as soon as they are queued, so they go ahead of the alerts
+  they replace.  msgSend_mutex must be held.
+
+------------------------------------------------------------------------*/
+
+void _msgSend_QueueXfers( pushXfer_t *head, pushXfer_t *tail, int count )
+{
+   pushXfer_t **pptr;
+
+   if ( pending_tail == NULL )
+   {
+      pptr = &pending_head;
+   }
+   else if ( pending_tail->due_ms <= head->due_ms )
+   {
+      pptr = &pending_tail->next;              // usual case, newest last
+   }
+   else
+   {
+      for ( pptr = &pending_head; (*pptr)->due_ms <= head->due_ms; pptr = &(*pptr)->next );
+   }
+
+   tail->next = *pptr;
+   *pptr = head;
+   if ( tail->next == NULL )
+   {
+      pending_tail = tail;
+   }
+   n_pending += count;
+}
+
+
+/*-------------------------( _msgSend_FindBox )-------------------------
+
+  Find the mailbox of a phone with a push going.
+  If create is set and it isn't there, an empty one is added.
+
+  Returns mailbox, NULL if phone isn't busy (or out of memory)
+---------------------------------------------------------------------*/
+
+phoneBox_t *_msgSend_FindBox( char *ip_addr, int create )
+{
+   phoneBox_t *box;
+   unsigned int h;
+
+   if ( box_size == 0 )
+   {
+      return NULL;                     // no mailboxes, pushes to a phone may overlap
+   }
+
+   h = _msgSend_BoxHash( ip_addr );
+
+   for ( box = box_tab[h]; box != NULL; box = box->next )
+   {
+      if ( strcmp( box->ip_addr, ip_addr ) == 0 )
+      {
+         return box;
+      }
+   }
+
+   if ( create && (box = calloc( 1, sizeof( phoneBox_t ))) != NULL )
+   {
+      strcpy( box->ip_addr, ip_addr );
+      box->next = box_tab[h];
+      box_tab[h] = box;
+   }
+   return box;
+}
+
+
+/*-------------------------( _msgSend_BoxHash )-------------------------
+
+  Hash an IP address string into a mailbox bucket
+
+---------------------------------------------------------------------*/
+
+unsigned int _msgSend_BoxHash( char *ip_addr )
+{
+   return _msgSend_IpHash( ip_addr ) & (box_size - 1);
+}
+
+
+// Hash an IP address string (FNV-1a)
+
+unsigned int _msgSend_IpHash( char *ip_addr )
+{
+   unsigned int h = 2166136261u;
+
+   while ( *ip_addr != '\0' )
+   {
+      h = (h ^ (unsigned char)*ip_addr++) * 16777619u;
+   }
+   return h;
+}
+
+
+/*-------------------------( _msgSend_BoxPost )-------------------------
+
+  Leave a push in a busy phone's mailbox.  If a push about the same
+  alarm is already waiting, the older of the two is dropped, so the
+  phone only gets the latest word on each alarm.
+
+---------------------------------------------------------------------*/
+
+void _msgSend_BoxPost( phoneBox_t *box, pushXfer_t *xfer )
+{
+   pushXfer_t *old;
+   pushXfer_t **pptr;
+
+   xfer->next = NULL;
+   for ( pptr = &box->waiting; (old = *pptr) != NULL; pptr = &old->next )
+   {
+      if ( xfer->fanout->about >= 0 && old->fanout->about == xfer->fanout->about )
+      {
+         if ( xfer->fanout->start_ms < old->fanout->start_ms )
+         {
+            _msgSend_Coalesce( xfer );         // (old retry) already out of date
+            return;
+         }
+         *pptr = old->next;
+         _msgSend_Coalesce( old );
+         break;
+      }
+   }
+
+   for ( ; *pptr != NULL; pptr = &(*pptr)->next );
+   *pptr = xfer;                               // on the end
+}
+
+
+/*-------------------------( _msgSend_BoxDone )-------------------------
+
+  A push is done with its phone (finished or waiting to retry).
+  The next one in the phone's mailbox goes on the pending list, in
+  order of when due.  The mailbox is freed when empty.
+
+---------------------------------------------------------------------*/
+
+void _msgSend_BoxDone( pushXfer_t *xfer )
+{
+   phoneBox_t *box;
+   phoneBox_t **pptr;
+   pushXfer_t *next;
+
+   if ( (box = _msgSend_FindBox( xfer->ip_addr, 0 )) == NULL || box->busy != xfer )
+   {
+      return;
+   }
+
+   if ( (next = box->waiting) != NULL )
+   {
+      box->waiting = next->next;
+      box->busy = next;
+
+      pthread_mutex_lock( &msgSend_mutex );
+      _msgSend_QueueXfers( next, next, 1 );
+      pthread_mutex_unlock( &msgSend_mutex );
+      return;
+   }
+
+   for ( pptr = &box_tab[ _msgSend_BoxHash( box->ip_addr ) ]; *pptr != box; pptr = &(*pptr)->next );
+   *pptr = box->next;                          // phone not busy any more
+   free( box );
+}
+
+
+/*-------------------------( _msgSend_Coalesce )-------------------------
+
+  Drop a waiting push that a newer one for the same alarm replaced.
+
+----------------------------------------------------------------------*/
+
+void _msgSend_Coalesce( pushXfer_t *xfer )
+{
+   Log( DEBUG, "%s: Newer message for alarm %d replaces waiting push to %s\n", __func__, xfer->fanout->about, xfer->ip_addr );
+   if ( xfer->probe )
+   {
+      spConn_ProbeCancelled( xfer->ip_addr );
+   }
+   pthread_mutex_lock( &msgSend_mutex );
+   stats.coalesced++;
+   pthread_mutex_unlock( &msgSend_mutex );
+   _msgSend_XferFinish( xfer, MSGSEND_CANCELLED, 0 );
+}
+
+
+/*-------------------------( _msgSend_LogResult )-------------------------
+
+  Log the push result for one phone.
+
+-----------------------------------------------------------------------*/
+
+void _msgSend_LogResult( msgSend_phoneResult_t *res )
+{
+   if ( res->result == MSGSEND_OK )
+   {
+      PLog( INFO, "%s Msg push successful to \"%s\" (%d ms)\n", __func__, res->ip_addr, res->latency_ms );
+   }
+   else if ( res->result == MSGSEND_REJECTED )
+   {
+      PLog( WARN, "%s Send Failed on \"%s\". Response code: %ld\n\n", __func__, res->ip_addr, res->httpCode );
+   }
+}
+
+
+/*-------------------------( _msgSend_NowMs )-------------------------
+
+  Return a monotonic time stamp in milliseconds
+
+-------------------------------------------------------------------*/
+
+long _msgSend_NowMs( void )
+{
+   struct timespec ts;
+
+   clock_gettime( CLOCK_MONOTONIC, &ts );
+   return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*-------------------------( _msgSender_WriteCallback )-------------------------
+  This function receives data from the phones in response to the data push.
+  We don't want to do anything with it, we just don't want it to go to stdout.
+  Data pointed to by buffer is NOT null-terminated!
+
+  This function MUST return the total number of bytes passed to it!
+-----------------------------------------------------------------------------*/
+
+size_t _msgSend_WriteCallback( void *buffer, size_t size, size_t nmemb, void *data )
+{
+//   printf( "%s called for address %s\n", __func__, ((pushXfer_t *)data)->ip_addr );
+
+//   printf( "Size: %d:%d, Data: \n", (int)size, (int)nmemb );
+//   fwrite( buffer, size, nmemb, stdout );
+
+   return size * nmemb;         // Tell curl we've handled the data
+}
+
+/*-------------------------( _msgSend_HeaderCallback )-------------------------
+  Receives the response headers from the phone, one line at a time.
+  Saves any digest challenge so the nonce can be cached.
+  Data pointed to by buffer is NOT null-terminated!
+-----------------------------------------------------------------------------*/
+
+size_t _msgSend_HeaderCallback( char *buffer, size_t size, size_t nitems, void *data )
+{
+   pushXfer_t *xfer = (pushXfer_t *)data;
+   size_t len = size * nitems;
+   size_t hlen = sizeof( "WWW-Authenticate:" ) - 1;
+
+   if ( len > hlen && strncasecmp( buffer, "WWW-Authenticate:", hlen ) == 0 )
+   {
+      buffer += hlen;
+      len -= hlen;
+      while ( len > 0 && (buffer[len-1] == '\r' || buffer[len-1] == '\n') )
+      {
+         len--;
+      }
+      if ( len >= sizeof( xfer->challenge ) )
+      {
+         len = sizeof( xfer->challenge ) - 1;
+      }
+      memcpy( xfer->challenge, buffer, len );
+      xfer->challenge[len] = '\0';
+   }
+
+   return size * nitems;
+}
+
+
+/*-------------------------( _msgSend_ReadCallback )-------------------------
+  Gives curl the next part of a gathered message
+-----------------------------------------------------------------------------*/
+
+size_t _msgSend_ReadCallback( char *buffer, size_t size, size_t nitems, void *data )
+{
+   pushXfer_t *xfer = (pushXfer_t *)data;
+   int n;
+
+   n = msgBuf_Read( xfer->msg, xfer->sent, buffer, size * nitems );
+   xfer->sent += n;
+   return n;
+}
+
+/*-------------------------( _msgSend_SeekCallback )-------------------------
+  curl wants to send the message again (answering a digest challenge)
+-----------------------------------------------------------------------------*/
+
+int _msgSend_SeekCallback( void *data, curl_off_t offset, int origin )
+{
+   pushXfer_t *xfer = (pushXfer_t *)data;
+
+   if ( origin != SEEK_SET || offset < 0 || offset > xfer->msg->len )
+   {
+      return CURL_SEEKFUNC_CANTSEEK;
+   }
+   xfer->sent = (int)offset;
+   return CURL_SEEKFUNC_OK;
+}
+
+/*-------------------------( _msgSend_Digest )-------------------------
+  MD5 of a message (hex), plain or gathered
+-----------------------------------------------------------------------*/
+
+void _msgSend_Digest( msgBuf_t *msg, char hex[33] )
+{
+   unsigned char digest[16];
+   md5_ctx_t ctx;
+   int i;
+
+   if ( msg->n_iov == 0 )
+   {
+      md5_Hex( msg->data, msg->len, hex );
+      return;
+   }
+
+   md5_Init( &ctx );
+   for ( i = 0; i < msg->n_iov; i++ )
+   {
+      md5_Update( &ctx, msg->iov[i].iov_base, msg->iov[i].iov_len );
+   }
+   md5_Final( &ctx, digest );
+   md5_HexDigest( digest, hex );
+}
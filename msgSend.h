@@ -6,6 +6,8 @@
  * 
  *  @section Description
  *  Creates and sends the HTML messages to the phones in parallel using libcurl
+ *  multi transfers, driven from the web server's event loop (or a sender
+ *  thread of their own).
  *
  */
 
@@ -13,10 +15,119 @@
 #ifndef _MSGSEND_H_
 #define _MSGSEND_H_
 
+#include "spRec.h"
+#include "msgBuf.h"
+
 #define MSGSEND_ACCEPT    0
 #define MSGSEND_COMPLETE  1
+#define MSGSEND_ALERT     2       // message type of alerts (in fan-out)
+
+/*--- Push results ---*/
+#define MSGSEND_OK        0       // phone returned 200
+#define MSGSEND_REJECTED  1       // phone answered with some other HTTP code
+#define MSGSEND_FAILED    2       // connection failed, timed out, or couldn't be queued
+#define MSGSEND_SKIPPED   3       // phone skipped, known to be unreachable
+#define MSGSEND_CANCELLED 4       // push cancelled (alarm accepted)
+#define MSGSEND_UNCHANGED 5       // not sent, phone already showing the message
+#define MSGSEND_EXPIRED   6       // not sent, deadline passed while waiting
+
+/*--- Result of the push to one phone ---*/
+typedef struct
+{
+   char ip_addr[MAX_IP_ADDR+1];        // IP address of the phone
+   int result;                         // MSGSEND_OK, MSGSEND_REJECTED, ... MSGSEND_CANCELLED
+   long httpCode;                      // HTTP response code from phone (0 if none)
+   int latency_ms;                     // time from queueing to finish
+}msgSend_phoneResult_t;
+
+/*--- Sender statistics ---*/
+typedef struct
+{
+   unsigned long sent;                 // pushes sent
+   unsigned long ok;                   // pushes that got HTTP 200
+   unsigned long rejected;             // pushes answered with another HTTP code
+   unsigned long failed;               // pushes that couldn't reach the phone
+   unsigned long skipped;              // pushes skipped by the circuit breaker
+   unsigned long cancelled;            // pushes cancelled before finishing
+   unsigned long retried;              // failed pushes sent again
+   unsigned long coalesced;            // waiting pushes replaced by a newer one for the same alarm
+   unsigned long unchanged;            // pushes not sent, phone already showing the message
+   unsigned long expired;              // pushes dropped, deadline passed while waiting
+}msgSend_stats_t;
+
+typedef struct msgSend_fanout_s msgSend_fanout_t;
+
+struct event_base;
+
+/** @brief Called from the sender (server event loop or sender thread) when the push to one phone is finished
+ *
+ * @param res Result for the phone
+ * @param data Data pointer given when the push was queued
+ */
+typedef void (*msgSend_PhoneCB_t)( msgSend_phoneResult_t *res, void *data );
+
+/** @brief Called once every phone in a fan-out has finished (or right away if there were no phones)
+ *
+ * The fan-out and its results are freed when this returns.
+ *
+ * @param fanout Aggregated results
+ * @param data Data pointer given when the push was queued
+ */
+typedef void (*msgSend_FanoutCB_t)( msgSend_fanout_t *fanout, void *data );
+
+/*--- One message pushed to a set of phones ---*/
+struct msgSend_fanout_s
+{
+   int alarm;                          // alarm number (-1 if not an alert)
+   int level;                          // escalation level of alert (-1 if not an alert)
+   int about;                          // alarm the message is about, alert or accept (-1 if none)
+   int type;                           // MSGSEND_ALERT, MSGSEND_ACCEPT or MSGSEND_COMPLETE (-1 if other)
+   char *dept;                         // department of alert (NULL if not an alert)
+   int n_phones;                       // number of phones pushed to
+   int n_done;                         // number finished so far
+   int n_ok;                           // number that got it (HTTP 200)
+   int cancelled;                      // true if any pushes were cancelled
+   int n_tried;                        // number whose first try is over (done or waiting to retry)
+   int escalated;                      // true if the alarm was escalated before the retries were done
+   msgSend_phoneResult_t *results;     // one per phone
+   msgBuf_t *msg;                      // message pushed (fan-out holds a reference)
+   msgBuf_t *special_msg;              // message for the special phone (may be NULL)
+   char msg_md5[33];                   // digest of msg (hex)
+   char special_md5[33];               // digest of special_msg (hex)
+
+   msgSend_PhoneCB_t phone_cb;         // called as each phone finishes (may be NULL)
+   msgSend_FanoutCB_t done_cb;         // called when all are done (may be NULL)
+   void *cb_data;                      // passed to callbacks
+   long start_ms;                      // when fan-out was queued
+};
+
+void msgSend_Init( void );                                        // set up the sender
+void msgSend_SetEventBase( struct event_base *base );             // run pushes from the web server's event loop
+int msgSend_GetQueueDepth( int *max_depth );                      // pushes waiting for the sender
+void msgSend_GetStats( msgSend_stats_t *stats );                  // copy of sender statistics
+void msgSend_LogStats( void );                                    // log statistics now and then (housekeeping)
 
 void msgSend_PushAlert( char *dept, int alarm, int level );       // send Alert message to all available phones
-void msgSend_PushAccept( char *dept, int type, char *accept_ip ); // send Accept or complete message to all available phones
+
+/** @brief Send Alert message to all available phones, report results through callbacks
+ *
+ * msgSend_PushAlert uses this with a callback that escalates the alarm
+ * right away if no phone got the alert.\n
+ * If "progressive_first" is set in the config, a first alert goes to that
+ * many of the department's phones with the best ack history, and to the
+ * rest only if it isn't acked within "progressive_wait_ms" (or none of
+ * them got it).  Then done_cb reports the second push, and isn't called
+ * if the alarm is accepted before it.
+ *
+ * @param dept Department name
+ * @param alarm Alarm number
+ * @param level Alarm escalation level
+ * @param phone_cb Called as each phone finishes (may be NULL)
+ * @param done_cb Called when all phones are finished (may be NULL)
+ * @param data Passed to the callbacks
+ */
+void msgSend_PushAlertAsync( char *dept, int alarm, int level, msgSend_PhoneCB_t phone_cb, msgSend_FanoutCB_t done_cb, void *data );
+void msgSend_PushAccept( char *dept, int alarm, int type, char *accept_ip ); // send Accept or complete message to all available phones
+void msgSend_CancelAlarm( int alarm );                            // cancel alert pushes still going out for alarm
 
 #endif
@@ -11,6 +11,7 @@
  */
 
 #include <event2/event.h>
+#include <event2/thread.h>
 #include <event2/buffer.h>
 #include <event2/http.h>
 #include <event2/keyvalq_struct.h>
@@ -37,6 +38,8 @@
 #include "msgSend.h"
 #include "msgXML.h"
 #include "spRec.h"
+#include "spConn.h"
+#include "ackRank.h"
 #include "config.h"
 #include "logging.h"
 #include "startup.h"
@@ -64,6 +67,7 @@ char serverIpAddress[ 40 ];    // our own IP address
 void server_Init( pthread_t *tid )
 {
    _server_getOurIP();
+   evthread_use_pthreads();            // other threads wake the loop to send pushes
    // Start the web server thread
    pthread_create( tid, NULL, _server_DispatchThread, NULL );
 }
@@ -112,6 +116,8 @@ void *_server_DispatchThread( void *arg )
    evhttp_set_cb( http_server, "/", _server_post_handler, NULL );
    evhttp_set_gencb(http_server, _server_generic_handler, NULL);
 
+   msgSend_SetEventBase( base );          // phone pushes run from this loop too
+
    Log( INFO, "%s: Web server start OK! \n", __func__ );
    printf("%s: Web server start OK \n", __func__ );
    MainSignal( 0, "OK" );                                 // Report to startup code
@@ -176,6 +182,7 @@ void _server_post_handler( struct evhttp_request *req, void *state )
 #endif
       PLog( DEBUG, "Got registration from %s, Line Number %s\n", phone_reg->phoneIP, phone_reg->LineNumber );
       spRec_AddRecord( phone_reg->phoneIP, phone_reg->MACAddress, atoi(phone_reg->LineNumber) );
+      spConn_ClearShown( phone_reg->phoneIP );        // phone (re)started, screen is blank
    }
 
    evhttp_send_reply(req, HTTP_OK, "OK", NULL);
@@ -211,7 +218,11 @@ void _server_activate_handler(struct evhttp_request *req, void *state)
       if (strcasestr( val, "ack" ))
       {
          PLog( NOTICE, "Alarm %s accepted by %s\n", alarm, req->remote_host );
-         msgSend_PushAccept( (char *)dept, MSGSEND_ACCEPT, req->remote_host );
+         if ( dept != NULL && alarm != NULL )
+         {
+            ackRank_Acked( (char *)dept, atoi(alarm), req->remote_host );    // for progressive alerts
+         }
+         msgSend_PushAccept( (char *)dept, alarm ? atoi(alarm) : -1, MSGSEND_ACCEPT, req->remote_host );
          msgQueue_SetAccept();          // delay before next alarm msg
          ack_alarm_num_no_verify( atoi(alarm), ALARM_PHONE_ACK );     // ack alarm
       }
@@ -0,0 +1,1007 @@
+/**
+ *  @file   spConn.c
+ *  @author Ron Weiland, Indyme Solutions
+ *  @date   4/6/15
+ *  @brief  Per-phone connection pool
+ *
+ *  @section Description
+ *
+ * Keeps a curl handle and the open (keep-alive) sockets for each phone
+ * so pushes can reuse warm connections instead of doing a new TCP
+ * handshake for every alert.\n
+ * Sockets are tracked through the curl open / close socket callbacks.
+ * A phone's sockets are shut down when they have been idle too long,
+ * when too many phones have open connections (least recently used goes first),
+ * or when the phone is removed from the phone records.\n
+ * Also runs a circuit breaker per phone.  After enough pushes in a row
+ * can't reach a phone, it is skipped for a cool-down period that doubles
+ * each time a probe push fails.\n
+ * Keeps a round trip time estimate for each phone (smoothed average plus
+ * variation, like TCP's retransmit timer) used to set push timeouts.\n
+ * Entries are found by hashing the phone's IP address, and sockets by a
+ * table indexed by socket number, so lookups don't grow with the number
+ * of phones.  The hash is sized from the phone records' max phones.\n
+ * Remembers the last message each phone took, so a push that wouldn't
+ * change the phone's display can be left out.\n
+ * For HTTPS pushes, curl keeps TLS sessions in each easy handle, keyed
+ * by host and port.  The phone's handle stays in the pool between pushes,
+ * so a new connection to the phone resumes its last session instead of
+ * doing a full handshake.  (A curl share handle would hold only 8 sessions
+ * for all the phones.)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "spConn.h"
+#include "config.h"
+#include "logging.h"
+
+static SPconn_t *pool_head;                  // list of phones in pool
+static SPconn_t **hash_tab;                  // pool entries by IP address hash
+static unsigned int hash_size;               // number of hash buckets (power of 2)
+static SPconn_t **sock_owner;                // pool entry for each tracked socket, by socket number
+static int n_sock_owner;                     // size of sock_owner
+static pthread_mutex_t spConn_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int idle_timeout = 60;                // seconds before idle connections are closed
+static int pool_max = 50;                    // max phones to hold connections open to
+static time_t last_evict;                    // last time idle check was run
+
+static int breaker_fails = 3;                // failures in a row that open the circuit
+static int breaker_cooldown = 10;            // first cool-down (seconds)
+static int breaker_max_cooldown = 300;       // longest cool-down (seconds)
+static int probe_timeout = 1000;             // connect timeout for probe pushes (ms)
+
+static int tls_verify;                       // check phone certificates (HTTPS)
+static char *tls_ca_file;                    // CA certificates for checking phones (NULL for system's)
+
+static long min_timeout = 1000;              // shortest push timeout (ms), not below TCP's 1 s minimum RTO
+static long min_connect_timeout = 200;       // shortest connect timeout (ms)
+
+SPconn_t *_spConn_Find( char *ip_addr );
+unsigned int _spConn_Hash( char *ip_addr );
+void _spConn_SetOwner( curl_socket_t sock, SPconn_t *conn );
+SPconn_t *_spConn_Get( char *ip_addr );
+void _spConn_CloseSocks( SPconn_t *conn );
+void _spConn_Smooth( long *avg, long *var, long sample );
+curl_socket_t _spConn_OpenSocket( void *clientp, curlsocktype purpose, struct curl_sockaddr *address );
+int _spConn_CloseSocket( void *clientp, curl_socket_t sock );
+
+#if 0
+/*
+ * TLS resumption benchmark.  A local HTTPS stand-in phone (libevent and
+ * OpenSSL) takes pushes over a new connection each time, first with the
+ * session cache off (full handshakes), then with the pooled handle's
+ * cache on (resumed).
+ * Make a certificate with
+ *    openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=phone -keyout key.pem -out cert.pem
+ * link with spConn.o digest.o md5.o spRec.o config.o jconfig.o logging.o cJSON.o
+ * and -lcurl -levent -levent_openssl -lssl -lcrypto -lexpat -lpthread -lm, and run
+ *    ./tlsbench cert.pem key.pem [pushes]
+ */
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/bufferevent.h>
+#include <event2/bufferevent_ssl.h>
+#include <openssl/ssl.h>
+
+#define BENCH_IP   "127.0.0.1:8443"
+
+static int bench_reused;                     // handshakes the phone saw resumed
+
+static struct bufferevent *_bench_NewConn( struct event_base *base, void *arg )
+{
+   return bufferevent_openssl_socket_new( base, -1, SSL_new( (SSL_CTX *)arg ),
+                                          BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE );
+}
+
+static void _bench_Reply( struct evhttp_request *req, void *arg )
+{
+   struct bufferevent *bev = evhttp_connection_get_bufferevent( evhttp_request_get_connection( req ));
+
+   if ( SSL_session_reused( bufferevent_openssl_get_ssl( bev )))
+   {
+      bench_reused++;
+   }
+   evhttp_send_reply( req, 200, "OK", NULL );
+}
+
+static void *_bench_Phone( void *arg )
+{
+   event_base_dispatch( (struct event_base *)arg );
+   return NULL;
+}
+
+static void _bench_Run( char *what, int n, long cache )
+{
+   CURL *hnd;
+   curl_off_t connect_us, tls_us, total_us;
+   double hs_ms = 0.0;
+   double all_ms = 0.0;
+   int ok = 0;
+   int i;
+
+   bench_reused = 0;
+   for ( i = 0; i < n; i++ )
+   {
+      hnd = spConn_GetHandle( BENCH_IP );
+      spConn_SetOpts( hnd, BENCH_IP );
+      curl_easy_setopt( hnd, CURLOPT_SSL_SESSIONID_CACHE, cache );
+      curl_easy_setopt( hnd, CURLOPT_URL, "https://" BENCH_IP "/push" );
+      curl_easy_setopt( hnd, CURLOPT_POSTFIELDS, "<html></html>" );
+      curl_easy_setopt( hnd, CURLOPT_FRESH_CONNECT, 1L );          // new connection every push
+      curl_easy_setopt( hnd, CURLOPT_FORBID_REUSE, 1L );
+      if ( curl_easy_perform( hnd ) == CURLE_OK )
+      {
+         curl_easy_getinfo( hnd, CURLINFO_CONNECT_TIME_T, &connect_us );
+         curl_easy_getinfo( hnd, CURLINFO_APPCONNECT_TIME_T, &tls_us );
+         curl_easy_getinfo( hnd, CURLINFO_TOTAL_TIME_T, &total_us );
+         hs_ms += (tls_us - connect_us) / 1000.0;
+         all_ms += total_us / 1000.0;
+         ok++;
+      }
+      spConn_PutHandle( BENCH_IP, hnd );
+   }
+   printf( "%-8s %d of %d OK, handshake %.3f ms, push %.3f ms average, %d resumed\n",
+           what, ok, n, ok ? hs_ms / ok : 0.0, ok ? all_ms / ok : 0.0, bench_reused );
+}
+
+int main( int argc, char *argv[] )
+{
+   struct event_base *base;
+   struct evhttp *http;
+   SSL_CTX *ctx;
+   pthread_t tid;
+   int n;
+
+   if ( argc < 3 )
+   {
+      printf( "Usage: %s cert.pem key.pem [pushes]\n", argv[0] );
+      return 1;
+   }
+   n = (argc > 3) ? atoi( argv[3] ) : 500;
+
+   ctx = SSL_CTX_new( TLS_server_method() );
+   if ( SSL_CTX_use_certificate_chain_file( ctx, argv[1] ) != 1 || SSL_CTX_use_PrivateKey_file( ctx, argv[2], SSL_FILETYPE_PEM ) != 1 )
+   {
+      printf( "Can't load %s / %s\n", argv[1], argv[2] );
+      return 1;
+   }
+
+   base = event_base_new();
+   http = evhttp_new( base );
+   evhttp_set_bevcb( http, _bench_NewConn, ctx );
+   evhttp_set_gencb( http, _bench_Reply, NULL );
+   if ( evhttp_bind_socket( http, "127.0.0.1", 8443 ) != 0 )
+   {
+      printf( "Can't listen on 8443\n" );
+      return 1;
+   }
+   pthread_create( &tid, NULL, _bench_Phone, base );
+
+   curl_global_init( CURL_GLOBAL_ALL );
+   config_init( CFGNAME );
+   spConn_Init();
+
+   _bench_Run( "full", n, 0L );
+   _bench_Run( "resumed", n, 1L );
+   return 0;
+}
+#endif
+
+
+/*-----------------( spConn_Init )----------------------------
+
+  Read pool settings from config
+
+-----------------------------------------------------------*/
+
+void spConn_Init( void )
+{
+   int max_phones = spRec_GetMaxPhones();
+
+   idle_timeout = config_readInt( "phones", "conn_idle_timeout", 60 );
+   pool_max = config_readInt( "phones", "conn_pool_max", max_phones );
+   breaker_fails = config_readInt( "phones", "breaker_fails", 3 );
+   breaker_cooldown = config_readInt( "phones", "breaker_cooldown", 10 );
+   breaker_max_cooldown = config_readInt( "phones", "breaker_max_cooldown", 300 );
+   probe_timeout = config_readInt( "phones", "breaker_probe_timeout", 1000 );
+   min_timeout = config_readInt( "phones", "min_phone_timeout", 1000 );
+   min_connect_timeout = config_readInt( "phones", "min_connect_timeout", 200 );
+   tls_verify = config_readInt( "phones", "phone_tls_verify", 0 );        // phones usually have self-signed certificates
+   tls_ca_file = config_readStr( "phones", "phone_ca_file", NULL );
+   if ( config_readInt( "phones", "push_https", 0 ) && !tls_verify )
+   {
+      Log( WARN, "%s: push_https is on but phone_tls_verify is 0. Phone certificates aren't checked, so pushes can be intercepted or faked\n", __func__ );
+   }
+
+   // Keep hash chains short: at least 2 buckets per phone
+   for ( hash_size = 16; hash_size < (unsigned int)max_phones * 2; hash_size <<= 1 );
+   if ( (hash_tab = calloc( hash_size, sizeof( SPconn_t * ))) == NULL )
+   {
+      Log( ERROR, "%s: Can't malloc %u hash buckets!\n", __func__, hash_size );
+      hash_size = 0;
+   }
+
+   Log( DEBUG, "%s: Idle timeout %d seconds, pool size %d, %u buckets\n", __func__, idle_timeout, pool_max, hash_size );
+}
+
+
+/*-----------------( spConn_MaxConnects )----------------------------
+
+  Return how many connections curl should keep in its cache
+
+------------------------------------------------------------------*/
+
+int spConn_MaxConnects( void )
+{
+   return pool_max;
+}
+
+
+/*-----------------( spConn_GetHandle )----------------------------
+
+  Get the curl handle to push to a phone.
+  Gives back the phone's idle handle if there is one, else a new one.
+
+  Return handle, or NULL if out of memory
+----------------------------------------------------------------*/
+
+CURL *spConn_GetHandle( char *ip_addr )
+{
+   SPconn_t *conn;
+   CURL *hnd = NULL;
+
+   pthread_mutex_lock( &spConn_mutex );
+   if ( (conn = _spConn_Get( ip_addr )) != NULL )
+   {
+      hnd = conn->hnd;                  // borrow idle handle
+      conn->hnd = NULL;
+      conn->last_used = time( NULL );
+   }
+   pthread_mutex_unlock( &spConn_mutex );
+
+   if ( hnd == NULL )
+   {
+      hnd = curl_easy_init();
+   }
+   return hnd;
+}
+
+
+/*-----------------( spConn_PutHandle )----------------------------
+
+  Give back a handle when a push is finished.
+  Kept for the next push if the phone doesn't have one, else freed.
+
+----------------------------------------------------------------*/
+
+void spConn_PutHandle( char *ip_addr, CURL *hnd )
+{
+   SPconn_t *conn;
+
+   pthread_mutex_lock( &spConn_mutex );
+   if ( (conn = _spConn_Find( ip_addr )) != NULL )
+   {
+      conn->last_used = time( NULL );
+      if ( conn->hnd == NULL )
+      {
+         conn->hnd = hnd;              // keep it
+         hnd = NULL;
+      }
+   }
+   pthread_mutex_unlock( &spConn_mutex );
+
+   if ( hnd != NULL )
+   {
+      curl_easy_cleanup( hnd );
+   }
+}
+
+
+/*-----------------( spConn_SetOpts )----------------------------
+
+  Set the options on a curl handle so we can track the
+  connections it opens to the phone.
+
+---------------------------------------------------------------*/
+
+void spConn_SetOpts( CURL *hnd, char *ip_addr )
+{
+   curl_easy_setopt( hnd, CURLOPT_OPENSOCKETFUNCTION, _spConn_OpenSocket );
+   curl_easy_setopt( hnd, CURLOPT_OPENSOCKETDATA, ip_addr );
+   curl_easy_setopt( hnd, CURLOPT_CLOSESOCKETFUNCTION, _spConn_CloseSocket );
+   curl_easy_setopt( hnd, CURLOPT_CLOSESOCKETDATA, NULL );
+   curl_easy_setopt( hnd, CURLOPT_TCP_KEEPALIVE, 1L );
+   curl_easy_setopt( hnd, CURLOPT_MAXAGE_CONN, (long)idle_timeout * 2 );   // we do the idle closing
+
+   // HTTPS.  Sessions are cached in the handle, which stays with the phone
+   curl_easy_setopt( hnd, CURLOPT_SSL_SESSIONID_CACHE, 1L );
+   curl_easy_setopt( hnd, CURLOPT_SSL_VERIFYPEER, (long)tls_verify );
+   curl_easy_setopt( hnd, CURLOPT_SSL_VERIFYHOST, tls_verify ? 2L : 0L );
+   if ( tls_ca_file != NULL )
+   {
+      curl_easy_setopt( hnd, CURLOPT_CAINFO, tls_ca_file );
+   }
+}
+
+
+/*-----------------( spConn_Drop )----------------------------
+
+  Phone is gone.  Close its connections and free its entry.
+
+-----------------------------------------------------------*/
+
+void spConn_Drop( char *ip_addr )
+{
+   SPconn_t *conn;
+   SPconn_t **pptr;
+
+   pthread_mutex_lock( &spConn_mutex );
+   if ( (conn = _spConn_Find( ip_addr )) != NULL )
+   {
+      for ( pptr = &pool_head; *pptr != conn; pptr = &(*pptr)->next );
+      *pptr = conn->next;             // unlink from pool
+      if ( hash_size != 0 )
+      {
+         for ( pptr = &hash_tab[ _spConn_Hash( ip_addr ) ]; *pptr != conn; pptr = &(*pptr)->hnext );
+         *pptr = conn->hnext;         // and from its bucket
+      }
+      _spConn_CloseSocks( conn );
+   }
+   pthread_mutex_unlock( &spConn_mutex );
+
+   if ( conn != NULL )
+   {
+      Log( DEBUG, "%s: Dropping connections to %s\n", __func__, ip_addr );
+      if ( conn->hnd != NULL )
+      {
+         curl_easy_cleanup( conn->hnd );
+      }
+      free( conn );
+   }
+}
+
+
+/*-----------------( spConn_Evict )----------------------------
+
+  Close connections that have been idle too long.
+  If more phones than allowed have open connections, close
+  the least recently used ones.
+
+  Checks at most once a second.
+------------------------------------------------------------*/
+
+void spConn_Evict( void )
+{
+   SPconn_t *conn;
+   SPconn_t *oldest;
+   time_t curtime;
+   int n_open;
+
+   curtime = time( NULL );
+   if ( curtime == last_evict )
+   {
+      return;
+   }
+   last_evict = curtime;
+
+   pthread_mutex_lock( &spConn_mutex );
+
+   n_open = 0;
+   for ( conn = pool_head; conn != NULL; conn = conn->next )
+   {
+      if ( conn->n_socks != 0 && (curtime - conn->last_used) > idle_timeout )
+      {
+         Log( DEBUG, "%s: Closing idle connection to %s\n", __func__, conn->ip_addr );
+         _spConn_CloseSocks( conn );
+      }
+      if ( conn->n_socks != 0 )
+      {
+         n_open++;
+      }
+   }
+
+   while ( n_open > pool_max )
+   {
+      oldest = NULL;
+      for ( conn = pool_head; conn != NULL; conn = conn->next )
+      {
+         if ( conn->n_socks != 0 && (oldest == NULL || conn->last_used < oldest->last_used) )
+         {
+            oldest = conn;
+         }
+      }
+      Log( DEBUG, "%s: Pool full, closing connection to %s\n", __func__, oldest->ip_addr );
+      _spConn_CloseSocks( oldest );
+      n_open--;
+   }
+
+   pthread_mutex_unlock( &spConn_mutex );
+}
+
+
+/*-----------------( spConn_MakeAuth )----------------------------
+
+  Build a preemptive digest Authorization header for a phone
+  from its cached nonce.
+
+  Returns 0 if OK, -1 if no nonce cached for the phone
+----------------------------------------------------------------*/
+
+int spConn_MakeAuth( char *ip_addr, char *uri, char *username, char *out, int len )
+{
+   SPconn_t *conn;
+   int ret = -1;
+
+   pthread_mutex_lock( &spConn_mutex );
+   if ( (conn = _spConn_Find( ip_addr )) != NULL )
+   {
+      ret = digest_MakeHeader( &conn->auth, "POST", uri, username, out, len );
+   }
+   pthread_mutex_unlock( &spConn_mutex );
+
+   return ret;
+}
+
+
+/*-----------------( spConn_SaveChallenge )----------------------------
+
+  Cache the digest challenge (WWW-Authenticate value) from a phone.
+  nc_used is the nonce count already used with this nonce (by curl).
+
+  Returns 0 if OK, -1 if challenge can't be used
+--------------------------------------------------------------------*/
+
+int spConn_SaveChallenge( char *ip_addr, char *hdr, char *username, char *password, unsigned long nc_used )
+{
+   SPconn_t *conn;
+   int stale = 0;
+   int ret = -1;
+
+   pthread_mutex_lock( &spConn_mutex );
+   if ( (conn = _spConn_Get( ip_addr )) != NULL )
+   {
+      if ( (ret = digest_ParseChallenge( &conn->auth, hdr, username, password, &stale )) == 0 )
+      {
+         conn->auth.nc = nc_used;
+      }
+      else
+      {
+         *conn->auth.nonce = '\0';    // can't answer it ourselves, let curl do it
+      }
+   }
+   pthread_mutex_unlock( &spConn_mutex );
+
+   Log( DEBUG, "%s: %s challenge from %s%s\n", __func__, (ret == 0) ? "Cached" : "Can't use", ip_addr, stale ? " (stale)" : "" );
+   return ret;
+}
+
+
+/*-----------------( spConn_ClearAuth )----------------------------
+
+  Forget the cached nonce for a phone
+
+----------------------------------------------------------------*/
+
+void spConn_ClearAuth( char *ip_addr )
+{
+   SPconn_t *conn;
+
+   pthread_mutex_lock( &spConn_mutex );
+   if ( (conn = _spConn_Find( ip_addr )) != NULL )
+   {
+      *conn->auth.nonce = '\0';
+   }
+   pthread_mutex_unlock( &spConn_mutex );
+}
+
+
+/*-----------------( spConn_CheckBreaker )----------------------------
+
+  Check the circuit breaker for a phone.
+  Once the cool-down is over, one push is let through as a probe.
+
+  Returns SPCONN_SEND, SPCONN_PROBE, or SPCONN_SKIP
+-------------------------------------------------------------------*/
+
+int spConn_CheckBreaker( char *ip_addr )
+{
+   SPconn_t *conn;
+   int ret = SPCONN_SEND;
+
+   pthread_mutex_lock( &spConn_mutex );
+   if ( (conn = _spConn_Find( ip_addr )) != NULL )
+   {
+      if ( conn->breaker == SPCONN_HALF_OPEN )
+      {
+         ret = SPCONN_SKIP;              // wait for probe already out
+      }
+      else if ( conn->breaker == SPCONN_OPEN )
+      {
+         if ( time( NULL ) >= conn->open_until )
+         {
+            conn->breaker = SPCONN_HALF_OPEN;
+            ret = SPCONN_PROBE;
+         }
+         else
+         {
+            ret = SPCONN_SKIP;
+         }
+      }
+   }
+   pthread_mutex_unlock( &spConn_mutex );
+
+   return ret;
+}
+
+
+/*-----------------( spConn_ProbeTimeout )----------------------------
+
+  Return connect timeout (ms) to use for probe pushes
+
+-------------------------------------------------------------------*/
+
+int spConn_ProbeTimeout( void )
+{
+   return probe_timeout;
+}
+
+
+/*-----------------( spConn_PushResult )----------------------------
+
+  Record whether a push could reach the phone.
+  Opens the circuit after too many failures in a row; a failed probe
+  doubles the cool-down.  A failure while the circuit is open (a push
+  started before it opened) only counts; it does not touch the cool-down.
+  Any success closes it.
+
+-----------------------------------------------------------------*/
+
+void spConn_PushResult( char *ip_addr, int reached )
+{
+   SPconn_t *conn;
+
+   pthread_mutex_lock( &spConn_mutex );
+   if ( (conn = _spConn_Find( ip_addr )) != NULL )
+   {
+      if ( reached )
+      {
+         if ( conn->breaker != SPCONN_CLOSED )
+         {
+            PLog( INFO, "Phone %s reachable again\n", ip_addr );
+         }
+         conn->fails = 0;
+         conn->breaker = SPCONN_CLOSED;
+         conn->cooldown = 0;
+      }
+      else
+      {
+         conn->fails++;
+         if ( conn->breaker == SPCONN_HALF_OPEN )
+         {
+            conn->cooldown *= 2;          // probe failed, back off more
+            if ( conn->cooldown > breaker_max_cooldown )
+            {
+               conn->cooldown = breaker_max_cooldown;
+            }
+         }
+         else if ( conn->breaker == SPCONN_CLOSED && conn->fails >= breaker_fails && breaker_fails > 0 )
+         {
+            conn->cooldown = breaker_cooldown;
+         }
+         else
+         {
+            pthread_mutex_unlock( &spConn_mutex );   // still open, or below the limit
+            return;
+         }
+
+         conn->breaker = SPCONN_OPEN;
+         conn->open_until = time( NULL ) + conn->cooldown;
+         PLog( INFO, "Phone %s unreachable %d times. Skipping it for %d seconds\n", ip_addr, conn->fails, conn->cooldown );
+      }
+   }
+   pthread_mutex_unlock( &spConn_mutex );
+}
+
+
+/*-----------------( spConn_ProbeCancelled )----------------------------
+
+  A probe push was cancelled before it finished.
+  Let the next push probe the phone instead.
+
+---------------------------------------------------------------------*/
+
+void spConn_ProbeCancelled( char *ip_addr )
+{
+   SPconn_t *conn;
+
+   pthread_mutex_lock( &spConn_mutex );
+   if ( (conn = _spConn_Find( ip_addr )) != NULL && conn->breaker == SPCONN_HALF_OPEN )
+   {
+      conn->breaker = SPCONN_OPEN;
+      conn->open_until = time( NULL );
+   }
+   pthread_mutex_unlock( &spConn_mutex );
+}
+
+
+/*-----------------( spConn_GetTimeouts )----------------------------
+
+  Get the connect and total timeouts (ms) to use for a push to a phone.
+  Timeout is smoothed time + 4 * variation, kept between the configured
+  minimum and max_ms.  Phones with no history get max_ms.
+
+-------------------------------------------------------------------*/
+
+void spConn_GetTimeouts( char *ip_addr, long max_ms, long *connect_ms, long *total_ms )
+{
+   SPconn_t *conn;
+   long total = max_ms;
+   long connect = max_ms;
+
+   pthread_mutex_lock( &spConn_mutex );
+   if ( (conn = _spConn_Find( ip_addr )) != NULL )
+   {
+      if ( conn->srtt != 0 )
+      {
+         total = conn->srtt + 4 * conn->rttvar;
+      }
+      if ( conn->sconnect != 0 )
+      {
+         connect = conn->sconnect + 4 * conn->connvar;
+      }
+   }
+   pthread_mutex_unlock( &spConn_mutex );
+
+   total = (total < min_timeout) ? min_timeout : total;
+   total = (total > max_ms) ? max_ms : total;
+   connect = (connect < min_connect_timeout) ? min_connect_timeout : connect;
+   connect = (connect > total) ? total : connect;
+
+   *connect_ms = connect;
+   *total_ms = total;
+}
+
+
+/*-----------------( spConn_RttSample )----------------------------
+
+  Add measured times from a successful push to the phone's estimate.
+  connect_ms is 0 if an open connection was reused.
+
+----------------------------------------------------------------*/
+
+void spConn_RttSample( char *ip_addr, long connect_ms, long total_ms )
+{
+   SPconn_t *conn;
+
+   pthread_mutex_lock( &spConn_mutex );
+   if ( (conn = _spConn_Find( ip_addr )) != NULL )
+   {
+      _spConn_Smooth( &conn->srtt, &conn->rttvar, total_ms );
+      if ( connect_ms != 0 )
+      {
+         _spConn_Smooth( &conn->sconnect, &conn->connvar, connect_ms );
+      }
+   }
+   pthread_mutex_unlock( &spConn_mutex );
+}
+
+
+/*-----------------( spConn_RttBackoff )----------------------------
+
+  A push to the phone timed out.  Forget its times, so the next push
+  gets the full phone_timeout (like TCP backing off its RTO) and a
+  phone that only stalled for a moment isn't timed out again.
+
+----------------------------------------------------------------*/
+
+void spConn_RttBackoff( char *ip_addr )
+{
+   SPconn_t *conn;
+
+   pthread_mutex_lock( &spConn_mutex );
+   if ( (conn = _spConn_Find( ip_addr )) != NULL )
+   {
+      conn->srtt = 0;
+      conn->rttvar = 0;
+      conn->sconnect = 0;
+      conn->connvar = 0;
+   }
+   pthread_mutex_unlock( &spConn_mutex );
+}
+
+
+/*-----------------( spConn_IsShown )----------------------------
+
+  Check if the last message a phone took is the same one
+
+  Returns true if phone is showing it
+-------------------------------------------------------------*/
+
+int spConn_IsShown( char *ip_addr, int alarm, int level, int type, char *md5 )
+{
+   SPconn_t *conn;
+   int ret = 0;
+
+   pthread_mutex_lock( &spConn_mutex );
+   if ( (conn = _spConn_Find( ip_addr )) != NULL && *conn->shown_md5 != '\0' )
+   {
+      ret = conn->shown_alarm == alarm && conn->shown_level == level &&
+            conn->shown_type == type && strcmp( conn->shown_md5, md5 ) == 0;
+   }
+   pthread_mutex_unlock( &spConn_mutex );
+   return ret;
+}
+
+
+/*-----------------( spConn_SetShown )----------------------------
+
+  Record the message a phone took.  md5 is NULL if we don't know
+  what it is showing (push failed part way).
+
+-------------------------------------------------------------*/
+
+void spConn_SetShown( char *ip_addr, int alarm, int level, int type, char *md5 )
+{
+   SPconn_t *conn;
+
+   pthread_mutex_lock( &spConn_mutex );
+   if ( (conn = _spConn_Find( ip_addr )) != NULL )
+   {
+      conn->shown_alarm = alarm;
+      conn->shown_level = level;
+      conn->shown_type = type;
+      strcpy( conn->shown_md5, (md5 != NULL) ? md5 : "" );
+   }
+   pthread_mutex_unlock( &spConn_mutex );
+}
+
+
+/*-----------------( spConn_ClearShown )----------------------------
+
+  Forget what a phone is showing (phone rebooted)
+
+---------------------------------------------------------------*/
+
+void spConn_ClearShown( char *ip_addr )
+{
+   spConn_SetShown( ip_addr, -1, -1, -1, NULL );
+}
+
+
+/*-----------------( _spConn_Smooth )----------------------------
+
+  Add a sample to a smoothed average and variation
+  (RFC 6298: alpha = 1/8, beta = 1/4)
+
+-------------------------------------------------------------*/
+
+void _spConn_Smooth( long *avg, long *var, long sample )
+{
+   long diff;
+
+   if ( sample < 1 )
+   {
+      sample = 1;
+   }
+
+   if ( *avg == 0 )                   // first sample
+   {
+      *avg = sample;
+      *var = sample / 2;
+      return;
+   }
+
+   diff = *avg - sample;
+   if ( diff < 0 )
+   {
+      diff = -diff;
+   }
+   *var = (3 * *var + diff) / 4;
+   *avg = (7 * *avg + sample) / 8;
+}
+
+
+/*-----------------( _spConn_Find )----------------------------
+
+  Find pool entry for a phone.  Pool mutex must be held.
+
+  Return pointer to entry, or NULL if not found
+-----------------------------------------------------------*/
+
+SPconn_t *_spConn_Find( char *ip_addr )
+{
+   SPconn_t *conn;
+
+   if ( hash_size == 0 )
+   {
+      conn = pool_head;                // no hash table, search whole pool
+   }
+   else
+   {
+      conn = hash_tab[ _spConn_Hash( ip_addr ) ];
+   }
+
+   for ( ; conn != NULL; conn = (hash_size == 0) ? conn->next : conn->hnext )
+   {
+      if ( strcmp( conn->ip_addr, ip_addr ) == 0 )
+      {
+         return conn;
+      }
+   }
+   return NULL;
+}
+
+
+/*-----------------( _spConn_Hash )----------------------------
+
+  Hash an IP address string into a bucket number (FNV-1a)
+
+------------------------------------------------------------*/
+
+unsigned int _spConn_Hash( char *ip_addr )
+{
+   unsigned int h = 2166136261u;
+
+   while ( *ip_addr != '\0' )
+   {
+      h = (h ^ (unsigned char)*ip_addr++) * 16777619u;
+   }
+   return h & (hash_size - 1);
+}
+
+
+/*-----------------( _spConn_Get )----------------------------
+
+  Find pool entry for a phone, create it if not there.
+  Pool mutex must be held.
+
+  Return pointer to entry, or NULL if out of memory
+-----------------------------------------------------------*/
+
+SPconn_t *_spConn_Get( char *ip_addr )
+{
+   SPconn_t *conn;
+
+   if ( (conn = _spConn_Find( ip_addr )) != NULL )
+   {
+      return conn;
+   }
+
+   if ( (conn = calloc( 1, sizeof( SPconn_t ))) == NULL )
+   {
+      Log( ERROR, "%s: Can't malloc pool entry for %s!\n", __func__, ip_addr );
+      return NULL;
+   }
+   strncpy( conn->ip_addr, ip_addr, MAX_IP_ADDR );
+   conn->next = pool_head;
+   pool_head = conn;
+   if ( hash_size != 0 )
+   {
+      conn->hnext = hash_tab[ _spConn_Hash( conn->ip_addr ) ];
+      hash_tab[ _spConn_Hash( conn->ip_addr ) ] = conn;
+   }
+   return conn;
+}
+
+
+/*-----------------( _spConn_CloseSocks )----------------------------
+
+  Shut down all sockets open to a phone.
+  curl sees the dead connection and closes it through _spConn_CloseSocket
+
+-----------------------------------------------------------------*/
+
+void _spConn_CloseSocks( SPconn_t *conn )
+{
+   int i;
+
+   for ( i = 0; i < conn->n_socks; i++ )
+   {
+      shutdown( conn->socks[i], SHUT_RDWR );
+      _spConn_SetOwner( conn->socks[i], NULL );
+   }
+   conn->n_socks = 0;
+}
+
+
+/*-----------------( _spConn_SetOwner )----------------------------
+
+  Record which pool entry a socket belongs to (NULL to forget it).
+  Pool mutex must be held.
+
+---------------------------------------------------------------*/
+
+void _spConn_SetOwner( curl_socket_t sock, SPconn_t *conn )
+{
+   SPconn_t **tab;
+   int n;
+
+   if ( sock < 0 )
+   {
+      return;
+   }
+   if ( sock >= n_sock_owner )
+   {
+      if ( conn == NULL )
+      {
+         return;                      // never tracked
+      }
+      for ( n = (n_sock_owner != 0) ? n_sock_owner : 64; n <= sock; n *= 2 );
+      if ( (tab = realloc( sock_owner, n * sizeof( SPconn_t * ))) == NULL )
+      {
+         return;                      // just won't be tracked
+      }
+      memset( tab + n_sock_owner, 0, (n - n_sock_owner) * sizeof( SPconn_t * ));
+      sock_owner = tab;
+      n_sock_owner = n;
+   }
+   sock_owner[ sock ] = conn;
+}
+
+
+/*-----------------( _spConn_OpenSocket )----------------------------
+
+  curl callback to open a socket.  Record it against the phone.
+
+  clientp points to the phone's IP address
+-----------------------------------------------------------------*/
+
+curl_socket_t _spConn_OpenSocket( void *clientp, curlsocktype purpose, struct curl_sockaddr *address )
+{
+   SPconn_t *conn;
+   curl_socket_t sock;
+
+   if ( (sock = socket( address->family, address->socktype, address->protocol )) == CURL_SOCKET_BAD )
+   {
+      return CURL_SOCKET_BAD;
+   }
+
+   pthread_mutex_lock( &spConn_mutex );
+   if ( (conn = _spConn_Find( (char *)clientp )) != NULL && conn->n_socks < SPCONN_MAX_SOCKS )
+   {
+      conn->socks[ conn->n_socks++ ] = sock;
+      _spConn_SetOwner( sock, conn );
+   }
+   pthread_mutex_unlock( &spConn_mutex );
+
+   Log( DEBUG, "%s: New connection to %s\n", __func__, (char *)clientp );
+   return sock;
+}
+
+
+/*-----------------( _spConn_CloseSocket )----------------------------
+
+  curl callback to close a socket.  Forget it from the phone's entry.
+
+-----------------------------------------------------------------*/
+
+int _spConn_CloseSocket( void *clientp, curl_socket_t sock )
+{
+   SPconn_t *conn;
+   int i;
+
+   pthread_mutex_lock( &spConn_mutex );
+   if ( sock >= 0 && sock < n_sock_owner && (conn = sock_owner[ sock ]) != NULL )
+   {
+      for ( i = 0; i < conn->n_socks; i++ )
+      {
+         if ( conn->socks[i] == sock )
+         {
+            conn->socks[i] = conn->socks[ --conn->n_socks ];    // move last into its place
+            break;
+         }
+      }
+      sock_owner[ sock ] = NULL;
+   }
+   pthread_mutex_unlock( &spConn_mutex );
+
+   return close( sock );
+}
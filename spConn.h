@@ -0,0 +1,86 @@
+/**
+ *  @file   spConn.h
+ *  @author Ron Weiland, Indyme Solutions
+ *  @date   4/6/15
+ *  @brief  Per-phone connection pool, header file
+ *
+ *  @section Description
+ *
+ * Keeps a curl handle and the open (keep-alive) sockets for each phone
+ * so pushes can reuse warm connections.
+ *
+ */
+
+
+#ifndef _SPCONN_H_
+#define _SPCONN_H_
+
+#include <curl/curl.h>
+#include <time.h>
+
+#include "spRec.h"
+#include "digest.h"
+
+#define SPCONN_MAX_SOCKS  4           // max open sockets tracked per phone
+
+/*--- Circuit breaker states ---*/
+#define SPCONN_CLOSED     0           // phone OK, send to it
+#define SPCONN_OPEN       1           // phone unreachable, skip it
+#define SPCONN_HALF_OPEN  2           // probe push to phone in flight
+
+/*--- spConn_CheckBreaker return values ---*/
+#define SPCONN_SEND       0           // push normally
+#define SPCONN_PROBE      1           // push as a quick probe
+#define SPCONN_SKIP       2           // don't push
+
+typedef struct SPconn_s
+{
+   struct SPconn_s *next;              // next phone in pool
+   struct SPconn_s *hnext;             // next phone in same hash bucket
+   char ip_addr[MAX_IP_ADDR+1];        // IP address of phone
+   CURL *hnd;                          // idle curl handle for phone (NULL if lent out)
+   int socks[SPCONN_MAX_SOCKS];        // sockets currently open to phone
+   int n_socks;                        // number of open sockets
+   time_t last_used;                   // when last push finished
+   digest_t auth;                      // cached digest nonce for phone
+   int fails;                          // consecutive failed pushes
+   int breaker;                        // circuit breaker state
+   int cooldown;                       // seconds to skip phone once circuit opens
+   time_t open_until;                  // when open circuit may be probed
+   long srtt;                          // smoothed push round trip time (ms)
+   long rttvar;                        // round trip time variation (ms)
+   long sconnect;                      // smoothed connect time (ms)
+   long connvar;                       // connect time variation (ms)
+   int shown_alarm;                    // alarm of last message phone took
+   int shown_level;                    // its escalation level
+   int shown_type;                     // its message type
+   char shown_md5[33];                 // its digest ("" if not known)
+}SPconn_t;
+
+
+void spConn_Init( void );                              // read pool settings from config
+int spConn_MaxConnects( void );                        // max connections to keep open
+CURL *spConn_GetHandle( char *ip_addr );               // get curl handle to push to a phone
+void spConn_PutHandle( char *ip_addr, CURL *hnd );     // return handle when push is done
+void spConn_SetOpts( CURL *hnd, char *ip_addr );       // set socket tracking options on handle
+void spConn_Drop( char *ip_addr );                     // close everything for a removed phone
+void spConn_Evict( void );                             // close idle connections
+
+int spConn_MakeAuth( char *ip_addr, char *uri, char *username, char *out, int len );
+int spConn_SaveChallenge( char *ip_addr, char *hdr, char *username, char *password, unsigned long nc_used );
+void spConn_ClearAuth( char *ip_addr );
+
+int spConn_CheckBreaker( char *ip_addr );              // should we push to this phone?
+int spConn_ProbeTimeout( void );                       // connect timeout (ms) for probes
+void spConn_PushResult( char *ip_addr, int reached );  // record if phone could be reached
+void spConn_ProbeCancelled( char *ip_addr );           // probe push never finished
+
+void spConn_GetTimeouts( char *ip_addr, long max_ms, long *connect_ms, long *total_ms );
+void spConn_RttSample( char *ip_addr, long connect_ms, long total_ms );
+void spConn_RttBackoff( char *ip_addr );
+
+int spConn_IsShown( char *ip_addr, int alarm, int level, int type, char *md5 );   // phone showing this message?
+void spConn_SetShown( char *ip_addr, int alarm, int level, int type, char *md5 ); // phone took message (md5 NULL if not known)
+void spConn_ClearShown( char *ip_addr );                                          // phone's display not known
+
+#endif
@@ -29,6 +29,7 @@ SPphone_record_t *SPphones;                      // array of Spectralink phone r
 int _spRec_ParseFile( void );                    // Read JSON file and parse
 void _spRec_ParsePhones( char *data );           // read phone records from JSON
 void _spRec_EncodePhones( void );                // write phone records to JSON
+void _spRec_Remove( SPphone_record_t *sptr );    // free a record
 
 // Helper functions
 void _spRec_GetStr( cJSON *root, char *what, char *dest, int len );
@@ -36,6 +37,8 @@ void _spRec_GetInt( cJSON *root, char *what, int *dest );
 
 static char *outfile = BASEDIR "sp8440.json";     // output file name
 
+static void (*remove_hook)( char *ip_addr );      // called when a phone is removed
+
 #if 0
 
 int main( void )
@@ -71,7 +74,7 @@ int spRec_Init( void )
 
    memsize = (max_SPphones + 1) * sizeof( SPphone_record_t );
 
-   SPphones = (SPphone_record_t *)malloc( memsize );
+   SPphones = (SPphone_record_t *)calloc( 1, memsize );     // all records start out unused
    SPphones[ max_SPphones ].in_use = -1;     // sentinal node (end of array)
    Log( INFO, "%s: Created room for %d phones\n", __func__, max_SPphones );
    _spRec_ParseFile();
@@ -101,7 +104,7 @@ void spRec_CheckStale( void )
    {
       if ( (curtime - sptr->last_seen) > (max_time * 60) )
       {
-         sptr->in_use = 0;       // remove this one
+         _spRec_Remove( sptr );  // remove this one
          dirty = 1;              // database changed
          PLog( INFO, "Removing %s, Not seen in %ld minutes\n", sptr->ip_addr, (long)max_time );
          Log( DEBUG, "%s: Removing stale phone: %s. Not seen in %ld minutes\n", __func__, sptr->ip_addr, (long)max_time );
@@ -140,7 +143,7 @@ int spRec_AddRecord( char *ip_addr, char *mac, int line_num )
       same_ip =  !strcmp( sptr->ip_addr, ip_addr );
       if ( (same_mac && !same_ip) || (same_ip && !same_mac) )
       {
-         sptr->in_use = 0;                            // remove existing
+         _spRec_Remove( sptr );                       // remove existing
          Log( DEBUG, "%s: Removing old record for %s\n", __func__, ip_addr );
       }
    }
@@ -199,12 +202,55 @@ void spRec_RemoveIP( char *ip_addr )
 
    if ( (sptr = spRec_FindIP( ip_addr )) != NULL )
    {
-      sptr->in_use = 0;                  // Remove record
+      _spRec_Remove( sptr );             // Remove record
       _spRec_EncodePhones();             // Write new file
    }
 }
 
 
+/*---------------( spRec_SetRemoveHook )-------------------
+
+  Set function to call with the IP address of any phone
+  that is removed from the records.
+
+---------------------------------------------------------*/
+
+void spRec_SetRemoveHook( void (*hook)( char *ip_addr ) )
+{
+   remove_hook = hook;
+}
+
+
+/*---------------( spRec_GetMaxPhones )-------------------
+
+  Return the max number of phones allowed in the records.
+  Other modules size their tables from this.
+
+-------------------------------------------------------*/
+
+int spRec_GetMaxPhones( void )
+{
+   return max_SPphones;
+}
+
+
+/*---------------( _spRec_Remove )-------------------
+
+  Free a phone record and tell anyone interested
+
+---------------------------------------------------*/
+
+void _spRec_Remove( SPphone_record_t *sptr )
+{
+   sptr->in_use = 0;
+
+   if ( remove_hook != NULL )
+   {
+      (*remove_hook)( sptr->ip_addr );
+   }
+}
+
+
 /*---------------( spRec_FindIP )-------------------
 
   Find a phone record based on its IP address.
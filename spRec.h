@@ -34,5 +34,7 @@ SPphone_record_t *spRec_GetNextRecord( SPphone_record_t *sptr );
 int spRec_AddRecord( char *ip_addr, char *mac, int line_num );
 void spRec_RemoveIP( char *ip_addr );
 SPphone_record_t *spRec_FindIP( char *ip_addr );
+void spRec_SetRemoveHook( void (*hook)( char *ip_addr ) );
+int spRec_GetMaxPhones( void );                    // max phones the table will hold
 
 #endif
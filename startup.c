@@ -123,6 +123,9 @@ void *sp8440_Start( void *msg )
    // Initialize the phones records module
    spRec_Init();
 
+   // Start the phone message sender
+   msgSend_Init();
+
     // Start up server.  Calls MainSignal when started
    server_Init( &server_tid );
 
@@ -166,6 +169,7 @@ void *_main_thread( void *msg )
          _exit(1);
       }
       spRec_CheckStale();    // check for "stale" phones
+      msgSend_LogStats();    // sender statistics, now and then
       sleep( 1 );
    }
 }